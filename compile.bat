@@ -3,10 +3,20 @@
 if not exist "obj" md obj
 if not exist "bin" md bin
 
-cl /Ox /Iinclude /c /Fo:obj/hashmap.obj src/hashmap.c
-cl /Ox /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb.obj src/scb.c
-cl /Ox /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_file.obj src/scb_file.c
-cl /Ox /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_image.obj src/scb_image.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /c /Fo:obj/hashmap.obj src/hashmap.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /c /Fo:obj/parallel.obj src/parallel.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb.obj src/scb.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_chunk.obj src/scb_chunk.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_ext.obj src/scb_ext.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_index.obj src/scb_index.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_pipe.obj src/scb_pipe.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_plan.obj src/scb_plan.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_state.obj src/scb_state.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_stream.obj src/scb_stream.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_file.obj src/scb_file.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_image.obj src/scb_image.c
+cl /Ox /std:c11 /experimental:c11atomics /Iinclude /IC:\openssl-3\x64\include /c /Fo:obj/scb_bench.obj src/scb_bench.c
 
-link C:\openssl-3\x64\lib\libssl.lib C:\openssl-3\x64\lib\libcrypto.lib /OUT:bin/scb_file.exe obj/scb_file.obj obj/scb.obj obj/hashmap.obj
-link C:\openssl-3\x64\lib\libssl.lib C:\openssl-3\x64\lib\libcrypto.lib /OUT:bin/scb_image.exe obj/scb_image.obj obj/scb.obj obj/hashmap.obj
\ No newline at end of file
+link C:\openssl-3\x64\lib\libssl.lib C:\openssl-3\x64\lib\libcrypto.lib /OUT:bin/scb_file.exe obj/scb_file.obj obj/scb.obj obj/scb_chunk.obj obj/scb_ext.obj obj/scb_index.obj obj/scb_pipe.obj obj/scb_plan.obj obj/scb_state.obj obj/scb_stream.obj obj/parallel.obj obj/hashmap.obj
+link C:\openssl-3\x64\lib\libssl.lib C:\openssl-3\x64\lib\libcrypto.lib /OUT:bin/scb_image.exe obj/scb_image.obj obj/scb.obj obj/scb_chunk.obj obj/scb_ext.obj obj/scb_index.obj obj/scb_pipe.obj obj/scb_plan.obj obj/scb_state.obj obj/scb_stream.obj obj/parallel.obj obj/hashmap.obj
+link C:\openssl-3\x64\lib\libssl.lib C:\openssl-3\x64\lib\libcrypto.lib /OUT:bin/scb_bench.exe obj/scb_bench.obj obj/scb.obj obj/scb_chunk.obj obj/scb_ext.obj obj/scb_index.obj obj/scb_pipe.obj obj/scb_plan.obj obj/scb_state.obj obj/scb_stream.obj obj/parallel.obj obj/hashmap.obj
\ No newline at end of file
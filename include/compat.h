@@ -0,0 +1,443 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// The few POSIX calls used beyond standard C: threads, mmap, positional and
+// low-level file I/O, temporary files and directory listing. On POSIX
+// systems this only includes the usual headers, while on Windows it maps
+// them onto Win32. C11 atomics and _Thread_local come from the compiler
+// (MSVC needs /std:c11 /experimental:c11atomics, see compile.bat).
+
+#ifndef COMPAT_H
+#define COMPAT_H
+
+#ifndef _WIN32
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Frees memory from posix_memalign.
+#define aligned_free free
+
+// Makes `fd` read and write bytes untranslated (a no-op here).
+static inline void binary_mode(int fd)
+{
+    (void)fd;
+}
+
+#else
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#include <sys/stat.h>
+
+typedef intptr_t ssize_t;
+
+#ifndef PATH_MAX
+#define PATH_MAX MAX_PATH
+#endif
+
+// Threads
+
+typedef SRWLOCK pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+typedef HANDLE pthread_t;
+
+#define PTHREAD_MUTEX_INITIALIZER SRWLOCK_INIT
+
+static inline int pthread_mutex_init(pthread_mutex_t* m, const void* attr)
+{
+    (void)attr;
+    InitializeSRWLock(m);
+    return 0;
+}
+
+static inline int pthread_mutex_destroy(pthread_mutex_t* m)
+{
+    (void)m;
+    return 0;
+}
+
+static inline int pthread_mutex_lock(pthread_mutex_t* m)
+{
+    AcquireSRWLockExclusive(m);
+    return 0;
+}
+
+static inline int pthread_mutex_unlock(pthread_mutex_t* m)
+{
+    ReleaseSRWLockExclusive(m);
+    return 0;
+}
+
+static inline int pthread_cond_init(pthread_cond_t* c, const void* attr)
+{
+    (void)attr;
+    InitializeConditionVariable(c);
+    return 0;
+}
+
+static inline int pthread_cond_destroy(pthread_cond_t* c)
+{
+    (void)c;
+    return 0;
+}
+
+static inline int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m)
+{
+    return SleepConditionVariableSRW(c, m, INFINITE, 0) ? 0 : EINVAL;
+}
+
+static inline int pthread_cond_broadcast(pthread_cond_t* c)
+{
+    WakeAllConditionVariable(c);
+    return 0;
+}
+
+typedef struct compat_thread
+{
+    void* (*run)(void*);
+    void* arg;
+} compat_thread;
+
+static unsigned __stdcall compat_thread_run(void* p)
+{
+    compat_thread t = *(compat_thread*)p;
+    free(p);
+    t.run(t.arg);
+    return 0;
+}
+
+static inline int pthread_create(pthread_t* tid, const void* attr,
+                                 void* (*run)(void*), void* arg)
+{
+    (void)attr;
+    compat_thread* t = (compat_thread*)malloc(sizeof(*t));
+    if (t == NULL)
+        return EAGAIN;
+    *t = (compat_thread){ .run = run, .arg = arg };
+    uintptr_t h = _beginthreadex(NULL, 0, compat_thread_run, t, 0, NULL);
+    if (h == 0)
+    {
+        free(t);
+        return EAGAIN;
+    }
+    *tid = (HANDLE)h;
+    return 0;
+}
+
+static inline int pthread_join(pthread_t tid, void** ret)
+{
+    if (ret != NULL)
+        *ret = NULL;
+    WaitForSingleObject(tid, INFINITE);
+    CloseHandle(tid);
+    return 0;
+}
+
+static inline int pthread_detach(pthread_t tid)
+{
+    CloseHandle(tid);
+    return 0;
+}
+
+#define _SC_NPROCESSORS_ONLN 84
+
+static inline long sysconf(int name)
+{
+    (void)name;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (long)si.dwNumberOfProcessors;
+}
+
+#define CLOCK_MONOTONIC 1
+
+static inline int clock_gettime(int clock, struct timespec* ts)
+{
+    (void)clock;
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&c);
+    ts->tv_sec = (time_t)(c.QuadPart / f.QuadPart);
+    ts->tv_nsec = (long)(c.QuadPart % f.QuadPart * 1000000000 / f.QuadPart);
+    return 0;
+}
+
+// Memory
+
+static inline int posix_memalign(void** p, size_t align, size_t size)
+{
+    *p = _aligned_malloc(size, align);
+    return *p == NULL ? ENOMEM : 0;
+}
+
+#define aligned_free _aligned_free
+
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_SHARED 1
+#define MAP_PRIVATE 2
+#define MAP_NORESERVE 0
+#define MAP_FAILED ((void*)-1)
+#define MADV_SEQUENTIAL 0
+#define MADV_RANDOM 0
+
+// Maps `len` bytes of `fd` from `off`. The mapping object is closed right
+// away, as the view keeps it alive until munmap.
+static inline void* mmap(void* addr, size_t len, int prot, int flags, int fd,
+                         int64_t off)
+{
+    (void)addr;
+    bool write = prot & PROT_WRITE;
+    bool copy = write && (flags & MAP_PRIVATE);
+    uint64_t end = (uint64_t)off + len;
+    HANDLE m = CreateFileMappingA((HANDLE)_get_osfhandle(fd), NULL,
+                                  !write ? PAGE_READONLY : copy ?
+                                  PAGE_WRITECOPY : PAGE_READWRITE,
+                                  (DWORD)(end >> 32), (DWORD)end, NULL);
+    if (m == NULL)
+    {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    void* p = MapViewOfFile(m, !write ? FILE_MAP_READ : copy ?
+                            FILE_MAP_COPY : FILE_MAP_WRITE,
+                            (DWORD)((uint64_t)off >> 32), (DWORD)off, len);
+    CloseHandle(m);
+    if (p == NULL)
+    {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    return p;
+}
+
+static inline int munmap(void* addr, size_t len)
+{
+    (void)len;
+    return UnmapViewOfFile(addr) ? 0 : -1;
+}
+
+static inline int madvise(void* addr, size_t len, int advice)
+{
+    (void)addr;
+    (void)len;
+    (void)advice;
+    return 0;
+}
+
+// Files, always opened in binary mode
+
+#ifndef O_RDONLY
+#define O_RDONLY _O_RDONLY
+#define O_WRONLY _O_WRONLY
+#define O_RDWR _O_RDWR
+#define O_CREAT _O_CREAT
+#define O_TRUNC _O_TRUNC
+#define O_EXCL _O_EXCL
+#endif
+
+#define STDIN_FILENO 0
+#define STDOUT_FILENO 1
+#define STDERR_FILENO 2
+
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+#define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+
+static inline int compat_open(const char* path, int flags, ...)
+{
+    int mode = 0;
+    if (flags & _O_CREAT)
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    return _open(path, flags | _O_BINARY, mode & (_S_IREAD | _S_IWRITE));
+}
+
+static inline ssize_t compat_read(int fd, void* buf, size_t n)
+{
+    return _read(fd, buf, n < INT_MAX ? (unsigned)n : INT_MAX);
+}
+
+static inline ssize_t compat_write(int fd, const void* buf, size_t n)
+{
+    return _write(fd, buf, n < INT_MAX ? (unsigned)n : INT_MAX);
+}
+
+static inline ssize_t pread(int fd, void* buf, size_t n, int64_t off)
+{
+    OVERLAPPED o = { .Offset = (DWORD)off,
+                     .OffsetHigh = (DWORD)((uint64_t)off >> 32) };
+    DWORD done;
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), buf,
+                  n < INT_MAX ? (DWORD)n : INT_MAX, &done, &o))
+    {
+        if (GetLastError() == ERROR_HANDLE_EOF)
+            return 0;
+        errno = EIO;
+        return -1;
+    }
+    return done;
+}
+
+static inline ssize_t pwrite(int fd, const void* buf, size_t n, int64_t off)
+{
+    OVERLAPPED o = { .Offset = (DWORD)off,
+                     .OffsetHigh = (DWORD)((uint64_t)off >> 32) };
+    DWORD done;
+    if (!WriteFile((HANDLE)_get_osfhandle(fd), buf,
+                   n < INT_MAX ? (DWORD)n : INT_MAX, &done, &o))
+    {
+        errno = GetLastError() == ERROR_DISK_FULL ? ENOSPC : EIO;
+        return -1;
+    }
+    return done;
+}
+
+static inline int ftruncate(int fd, int64_t len)
+{
+    return _chsize_s(fd, len) == 0 ? 0 : -1;
+}
+
+// _chsize_s already writes out the blocks it adds to the file.
+static inline int posix_fallocate(int fd, int64_t off, int64_t len)
+{
+    (void)fd;
+    (void)off;
+    (void)len;
+    return 0;
+}
+
+// Unlike rename in the C library, replaces an existing `to`.
+static inline int compat_rename(const char* from, const char* to)
+{
+    if (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING))
+        return 0;
+    errno = EACCES;
+    return -1;
+}
+
+// An open file cannot be unlinked, so the file is instead removed when the
+// last descriptor or mapping of it is closed (and unlink fails harmlessly).
+static inline int mkstemp(char* path)
+{
+    if (_mktemp_s(path, strlen(path) + 1) != 0)
+        return -1;
+    return _open(path, _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY |
+                 _O_TEMPORARY, _S_IREAD | _S_IWRITE);
+}
+
+static inline void binary_mode(int fd)
+{
+    _setmode(fd, _O_BINARY);
+}
+
+#define open compat_open
+#define read(fd, buf, n) compat_read(fd, buf, n)
+#define write(fd, buf, n) compat_write(fd, buf, n)
+#define close(fd) _close(fd)
+#define lseek(fd, off, whence) _lseeki64(fd, off, whence)
+#define dup(fd) _dup(fd)
+#define dup2(fd, to) _dup2(fd, to)
+#define fileno(f) _fileno(f)
+#define fsync(fd) _commit(fd)
+#define unlink(path) _unlink(path)
+#define rename(from, to) compat_rename(from, to)
+#define strdup(s) _strdup(s)
+#define stat _stat64
+#define fstat _fstat64
+#define lstat _stat64
+
+// Directories
+
+struct dirent
+{
+    char d_name[MAX_PATH];
+};
+
+typedef struct DIR
+{
+    HANDLE find;
+    WIN32_FIND_DATAA data;
+    bool first;
+    struct dirent entry;
+} DIR;
+
+static inline DIR* opendir(const char* path)
+{
+    char pattern[MAX_PATH];
+    if (snprintf(pattern, MAX_PATH, "%s/*", path) >= MAX_PATH)
+        return NULL;
+    DIR* d = (DIR*)malloc(sizeof(*d));
+    if (d == NULL)
+        return NULL;
+    d->find = FindFirstFileA(pattern, &d->data);
+    if (d->find == INVALID_HANDLE_VALUE)
+    {
+        free(d);
+        return NULL;
+    }
+    d->first = true;
+    return d;
+}
+
+static inline struct dirent* readdir(DIR* d)
+{
+    if (!d->first && !FindNextFileA(d->find, &d->data))
+        return NULL;
+    d->first = false;
+    strcpy(d->entry.d_name, d->data.cFileName);
+    return &d->entry;
+}
+
+static inline int closedir(DIR* d)
+{
+    FindClose(d->find);
+    free(d);
+    return 0;
+}
+
+// Returns the directory part of `path`, cutting it in place.
+static inline char* dirname(char* path)
+{
+    char* slash = NULL;
+    for (char* c = path; *c != '\0'; ++c)
+        if (*c == '/' || *c == '\\')
+            slash = c;
+    if (slash == NULL)
+        return (char*)".";
+    if (slash == path)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+    return path;
+}
+
+#endif
+
+#endif
@@ -31,9 +31,31 @@ struct hashmap *hashmap_new_with_allocator(
                                            void *udata),
                             void (*elfree)(void *item),
                             void *udata);
+struct hashmap *hashmap_new_with_zeroed_allocator(
+                            void *(*malloc)(size_t), 
+                            void *(*realloc)(void *, size_t), 
+                            void (*free)(void*),
+                            size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata);
 void hashmap_free(struct hashmap *map);
+void hashmap_reset(struct hashmap *map);
+struct hashmap *hashmap_clone(struct hashmap *map);
+bool hashmap_snapshot(struct hashmap *map);
+void hashmap_commit(struct hashmap *map);
+bool hashmap_rollback(struct hashmap *map);
+bool hashmap_snapshotted(struct hashmap *map);
 void hashmap_clear(struct hashmap *map, bool update_cap);
 size_t hashmap_count(struct hashmap *map);
+void *hashmap_udata(struct hashmap *map);
+int hashmap_tag(struct hashmap *map);
+void hashmap_set_tag(struct hashmap *map, int tag);
+void hashmap_set_incremental(struct hashmap *map, bool incremental);
 bool hashmap_oom(struct hashmap *map);
 void *hashmap_get(struct hashmap *map, const void *item);
 void *hashmap_set(struct hashmap *map, const void *item);
@@ -42,6 +64,21 @@ void *hashmap_probe(struct hashmap *map, uint64_t position);
 bool hashmap_scan(struct hashmap *map,
                   bool (*iter)(const void *item, void *udata), void *udata);
 bool hashmap_iter(struct hashmap *map, size_t *i, void **item);
+void *hashmap_buckets(struct hashmap *map, size_t *nbuckets, size_t *bucketsz);
+struct hashmap *hashmap_new_with_buckets(size_t elsize, void *buckets,
+                            size_t nbuckets, size_t count,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata,
+                            void (*release)(void *arg), void *arg);
+uint64_t hashmap_hash(struct hashmap *map, const void *item);
+size_t hashmap_place(struct hashmap *map, const void *const *items, size_t n,
+                     size_t end);
+void hashmap_placed(struct hashmap *map, size_t count);
 
 uint64_t hashmap_sip(const void *data, size_t len, 
                      uint64_t seed0, uint64_t seed1);
@@ -0,0 +1,24 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+// Returns the number of threads to be used for a request of `threads`
+// threads, which is at most the size of the pool (see scb_pool_init), and
+// zero stands for all of them.
+size_t parallel_threads(const size_t threads);
+
+// Splits the range [0, n) into contiguous slices and calls `fn` once per
+// slice, as tasks of the pool using up to `threads` of its threads (zero
+// means all). The calling thread runs tasks too, and returns once all slices
+// are done.
+void parallel_for(const size_t threads, const size_t n,
+                  void (*fn)(size_t begin, size_t end, void* udata),
+                  void* udata);
+
+#endif
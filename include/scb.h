@@ -6,7 +6,9 @@
 #ifndef SCB_H
 #define SCB_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define USE_SHA // Use MD4 if undefined (faster).
 
@@ -14,12 +16,332 @@
 
 typedef struct hashmap* scb_state;
 
+// State of an incremental encryption or decryption (see scb_encrypt_init).
+typedef struct scb_stream
+{
+    uint8_t key[16];
+    size_t max_count;
+    size_t max_hash;
+    scb_state* mem;
+    bool sort;       // Encrypt with scb_encrypt_sort.
+    size_t threads;  // Threads of scb_encrypt_sort, and if not 1, decrypt
+                     // with scb_decrypt_parallel.
+    bool copy;       // Decrypt with scb_decrypt_copy.
+    uint8_t buf[32]; // Held back last full block and partial tail.
+    size_t buf_len;
+} scb_stream;
+
+// All parallel work runs on one pool of threads with work stealing, started
+// on first use, so that engines running side by side (or one within another)
+// share the processors rather than each starting threads of its own. Its
+// size is the value of the environment variable SCB_THREADS, or else the
+// number of online processors, unless set by scb_pool_init before the first
+// use (which returns false if too late). The `threads` of any call is then a
+// cap on the threads of the pool it uses, zero meaning all of them.
+bool scb_pool_init(const size_t threads);
+
+// Usage of the pool since it started. Over a period, the increase of `busy`
+// divided by the time elapsed and by `threads` is the utilization of the pool.
+typedef struct scb_pool_stats
+{
+    size_t threads; // Threads of the pool, including the one waiting for work
+    size_t tasks;   // Tasks run
+    size_t steals;  // Tasks run by another thread than the one that made them
+    double busy;    // Seconds spent running tasks, over all threads
+} scb_pool_stats;
+void scb_pool_usage(scb_pool_stats* stats);
+
+// Encrypts the `len` (at least 16) bytes of `ptx` into `ctx`, which may be
+// the same buffer to encrypt in place. The same holds for the other one-shot
+// functions below, except scb_encrypt_external.
 void scb_encrypt(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
                  const size_t len, const size_t max_count,
                  const size_t max_hash, scb_state* mem);
 
+// Same output and resulting state as scb_encrypt, but instead of looking up
+// every block in the state, hashes all blocks (over `threads` threads, zero
+// meaning one per processor), radix-sorts them by hash and assigns the
+// counts run by run. Faster for very large inputs. Returns false, leaving
+// `ctx` and the state as they were, if out of memory.
+bool scb_encrypt_sort(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem,
+                      const size_t threads);
+
+// Same output as scb_encrypt with a fresh state, but reads the `len` bytes
+// to encrypt from the file descriptor `ptx_fd` and writes them to `ctx_fd`
+// (both with positional I/O from offset zero), keeping memory usage within
+// `budget` bytes (all buffers included) by spilling hash-partitioned records
+// to three temporary files in `tmp_dir`, however many partitions there are.
+// The budget holds as long as it is at least about 128 times the square root
+// of `len`, beyond which the states of the partitions outgrow it. Returns 0
+// on success and -1 (with errno set) otherwise.
+int scb_encrypt_external(const uint8_t* key, const int ptx_fd,
+                         const int ctx_fd, const size_t len,
+                         const size_t max_count, const size_t max_hash,
+                         const size_t budget, const size_t threads,
+                         const char* tmp_dir);
+
+// Same output and resulting state as scb_encrypt on the whole input, but
+// reads the input from `ptx_fd` up to its end and writes the output to
+// `ctx_fd` (sequentially, so both may be pipes), through a pipeline of
+// buffers of `chunk` bytes (a multiple of 16) in which reading, hashing,
+// counting, AES and writing overlap, hashing and AES over `threads` threads
+// of the pool. Stores the number of bytes read in `len`, and returns 0 on
+// success and -1 (with errno set) otherwise.
+int scb_encrypt_pipeline(const uint8_t* key, const int ptx_fd,
+                         const int ctx_fd, const size_t max_count,
+                         const size_t max_hash, const size_t chunk,
+                         scb_state* mem, const size_t threads, size_t* len);
+
+// Number of partitions scb_encrypt_external uses for the given arguments
+// (at most 65536).
+size_t scb_external_partitions(const size_t len, const size_t budget,
+                               const size_t threads);
+
 void scb_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
                  const size_t len, const size_t max_count,
                  const size_t max_hash, scb_state* mem);
 
+// Same output and resulting state as scb_decrypt, but decrypts in two
+// parallel passes over `threads` threads (zero means one per processor):
+// first all blocks are decrypted and classified, then repeat blocks are
+// resolved against the earlier first occurrences. Returns false, leaving
+// `ptx` and the state as they were, if out of memory.
+bool scb_decrypt_parallel(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                          const size_t len, const size_t max_count,
+                          const size_t max_hash, scb_state* mem,
+                          const size_t threads);
+
+// Same output as scb_decrypt and scb_decrypt_parallel, but the state keeps
+// copies of the first occurrences instead of pointing into `ptx`, so the
+// output may be discarded as soon as it has been used, and the state grows
+// with the number of distinct blocks rather than with the input. A state of
+// these functions cannot be passed to scb_decrypt and vice versa. As with
+// scb_decrypt_parallel, scb_decrypt_parallel_copy returns false if out of
+// memory.
+void scb_decrypt_copy(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem);
+bool scb_decrypt_parallel_copy(const uint8_t* key, const uint8_t* ctx,
+                               uint8_t* ptx, const size_t len,
+                               const size_t max_count, const size_t max_hash,
+                               scb_state* mem, const size_t threads);
+
+// Chunked SCB, a mode of its own (with a different output than the above):
+// the message is split into chunks of `chunk` bytes (a multiple of 16), the
+// last one taking what is left (together with the chunk before it, if less
+// than 16 bytes), and each chunk is encrypted as a message of its own, with
+// a fresh state and the key scb_chunk_key derives for its index. Chunks are
+// thus processed in parallel over `threads` threads (zero meaning one per
+// processor), and repeats are only found within a chunk. `first` is the
+// index of the first chunk of `ptx`, so a message can also be passed in
+// pieces of whole chunks (the last one excepted), and any of its chunks
+// decrypted on its own.
+void scb_encrypt_chunked(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                         const size_t len, const size_t max_count,
+                         const size_t max_hash, const size_t chunk,
+                         const size_t first, const size_t threads);
+void scb_decrypt_chunked(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                         const size_t len, const size_t max_count,
+                         const size_t max_hash, const size_t chunk,
+                         const size_t first, const size_t threads);
+
+// Derives the key of chunk `index` (the encryption under `key` of the label
+// "SCBchunk" followed by the index), and counts the chunks of a message.
+void scb_chunk_key(const uint8_t* key, const size_t index, uint8_t* chunk_key);
+size_t scb_chunk_count(const size_t len, const size_t chunk);
+
+// Index of the first occurrences of an encrypted message, with which any
+// byte range of it can be decrypted on its own (see scb_decrypt_range).
+typedef struct scb_index
+{
+    size_t* entries; // Pairs of hash and block number, sorted by hash once
+                     // scb_index_final has been called.
+    size_t n;        // Number of pairs
+    size_t cap;
+    size_t blocks;   // Blocks added so far
+} scb_index;
+
+// Builds the index of a message encrypted with a fresh state. The message
+// is passed to scb_index_update in pieces of full blocks, each along with
+// its ciphertext, as written by scb_encrypt_update (or all at once), the
+// last one with `last` set, and then the pairs are sorted by
+// scb_index_final. The index takes 16 bytes per distinct block. Both return
+// false if out of memory, after which the index can only be freed.
+void scb_index_init(scb_index* idx);
+bool scb_index_update(scb_index* idx, const uint8_t* key, const uint8_t* ptx,
+                      const uint8_t* ctx, const size_t len,
+                      const size_t max_hash, const bool last);
+bool scb_index_final(scb_index* idx);
+void scb_index_free(scb_index* idx);
+
+// Decrypts the `count` bytes at `offset` of the ciphertext `ctx` of `len`
+// bytes into `ptx`, using the index of the message, in time proportional to
+// `count` (times the logarithm of the index size). The result equals the
+// corresponding bytes written by scb_decrypt, unless sequential decryption
+// went wrong before the range.
+void scb_decrypt_range(const uint8_t* key, const uint8_t* ctx,
+                       const size_t len, const size_t max_count,
+                       const size_t max_hash, const scb_index* idx,
+                       const size_t offset, const size_t count, uint8_t* ptx);
+
+// Incremental scb_encrypt: the message can be passed to scb_encrypt_update
+// in chunks of any size, and the concatenation of everything written by
+// scb_encrypt_update and scb_encrypt_final equals what scb_encrypt writes
+// for the whole message (which must be at least 16 bytes long). Up to 32
+// bytes are held back between calls, so scb_encrypt_update writes at most
+// `len + 16` bytes and scb_encrypt_final at most 32. Both return the number
+// of bytes written. The state `mem` is used as in scb_encrypt. The fields
+// `sort` and `threads` of the stream (false and 1 after init) select the
+// engine applied to each chunk, and may be changed at any time.
+void scb_encrypt_init(scb_stream* s, const uint8_t* key,
+                      const size_t max_count, const size_t max_hash,
+                      scb_state* mem);
+size_t scb_encrypt_update(scb_stream* s, const uint8_t* ptx, const size_t len,
+                          uint8_t* ctx);
+size_t scb_encrypt_final(scb_stream* s, uint8_t* ctx);
+
+// Incremental scb_decrypt, see scb_encrypt_init. As with scb_decrypt, the
+// state refers to the decrypted blocks, so all the output written so far
+// must stay in place while the state is in use.
+void scb_decrypt_init(scb_stream* s, const uint8_t* key,
+                      const size_t max_count, const size_t max_hash,
+                      scb_state* mem);
+size_t scb_decrypt_update(scb_stream* s, const uint8_t* ctx, const size_t len,
+                          uint8_t* ptx);
+size_t scb_decrypt_final(scb_stream* s, uint8_t* ptx);
+
+// Incremental scb_decrypt_copy, see scb_decrypt_init. The output can be
+// reused or discarded after each call, so decrypting a file this way takes
+// memory for one chunk plus the distinct blocks.
+void scb_decrypt_init_copy(scb_stream* s, const uint8_t* key,
+                           const size_t max_count, const size_t max_hash,
+                           scb_state* mem);
+
+// Writes an encryption state to `f`, or reads one written this way into a
+// fresh state `*mem`, returning whether it succeeded. Together with the
+// bytes held back by a stream, a saved state lets encryption continue later
+// (in another process) exactly where it stopped. The file holds the hash
+// table as it is in memory (it has no pointers), so loading does not
+// rebuild it, and scb_state_map even uses it in place: it maps the state
+// saved at `offset` of the file `path` (privately, so changes do not reach
+// the file), and pages are read as they are first accessed. The mapping
+// goes away with the state. Only encryption states can be saved, and not
+// during a snapshot (see scb_state_snapshot).
+bool scb_state_save(scb_state mem, FILE* f);
+bool scb_state_load(scb_state* mem, FILE* f);
+bool scb_state_map(scb_state* mem, const char* path, const size_t offset);
+
+// Creates an empty encryption state whose table is kept in a sparse file in
+// the directory `dir` (removed when the state is freed) rather than in
+// memory, for states larger than the memory. It is sized for `entries`
+// distinct blocks, and grows beyond that as usual (but at the cost of
+// rewriting it). The directory is shared by all such states of the process,
+// so this fails if `dir` differs from that of one not freed yet.
+bool scb_state_new_file(scb_state* mem, const char* dir, const size_t entries);
+
+// Creates an empty decryption state, for the functions with copies, that
+// takes at most `budget` bytes (at least a few kilobytes), evicting the
+// least recently used blocks to stay within it. A repeat block whose first
+// occurrence was evicted cannot be decrypted: it is left as decoded (and
+// not stored), and counted. With threads, such a state is processed by a
+// single one.
+bool scb_state_new_budget(scb_state* mem, const size_t budget);
+
+// Gets the number of blocks evicted from the state `mem` so far and of
+// repeat blocks left unresolved because of that (both 0 without budget).
+// Returns false if the latter is only a lower bound, which happens once
+// there is no more room to remember all evicted blocks.
+bool scb_state_budget_stats(scb_state mem, size_t* evictions,
+                            size_t* unresolved);
+
+// Frees the state `mem` (of any kind, or NULL).
+void scb_state_free(scb_state mem);
+
+// Empties the state `mem` for a new message, keeping its table (and kind)
+// as it is, so that it need not grow again. Takes constant time.
+void scb_state_reset(scb_state mem);
+
+// Creates `*copy` as an independent copy of the state `mem` (in memory, but
+// for a state with a budget or kept in a file, which are copied as such).
+bool scb_state_clone(scb_state mem, scb_state* copy);
+
+// Takes a snapshot of the state `mem` (not one with a budget), to try a
+// message and then either keep its changes with scb_state_commit or undo
+// them with scb_state_rollback. A snapshot takes constant time, and then
+// parts of the table (about a page each) are copied before they are first
+// changed, so that both commit and rollback only cost as much as what was
+// changed since. There is one snapshot at a time. Returns false if there
+// is one already (or if out of memory); rollback returns false (and keeps
+// the changes) if there is none or it could not be kept.
+bool scb_state_snapshot(scb_state mem);
+void scb_state_commit(scb_state mem);
+bool scb_state_rollback(scb_state mem);
+
+// Sets whether the state `mem` grows incrementally, for steady latency of
+// the per-message functions: a table that is full then moves its entries
+// to a larger one a few at a time, with every new entry, instead of all at
+// once. Lookups meanwhile check both tables, and the old one is freed once
+// empty. Growing during a snapshot still happens at once. A state is only
+// created by the first message, so this does nothing for a NULL one: set it
+// after the first (short) message.
+void scb_state_set_incremental(scb_state mem, const bool incremental);
+
+// What encrypting or decrypting an input takes, as estimated by
+// scb_estimate_input. Memory is the peak of a table growing as usual.
+typedef struct scb_estimate
+{
+    size_t blocks;       // Full blocks of the input
+    size_t sampled;      // Blocks sampled (all of them if as many)
+    size_t distinct;     // Distinct block hashes, i.e. entries of the state
+    size_t repeats;      // Repeats of the most frequent block
+    size_t enc_bytes;    // Encryption state (in memory or in a file)
+    size_t dec_bytes;    // Decryption state of copies
+    size_t budget_bytes; // Smallest budget of a decryption state that evicts
+                         // nothing (see scb_state_new_budget)
+    size_t index_bytes;  // Index (see scb_index_init)
+    double enc_rate;     // Bytes per second of scb_encrypt on the sample
+    double dec_rate;     // Bytes per second of scb_decrypt_copy on it
+} scb_estimate;
+
+// Estimates the number of distinct blocks of the `len` bytes of `ptx` from
+// `samples` blocks spread over it (all of them if zero or more), read over
+// `threads` threads (zero meaning one per processor), and from that the
+// memory each kind of state takes. Only the sampled blocks are accessed, so
+// `ptx` may be a mapping of a file of any size. The rates are measured with
+// `key` on the sample, so they leave out the cache misses of a larger state.
+// The estimate is exact if all blocks are sampled. Otherwise no estimate
+// from a sample can be tight for every input, but on uniform, skewed and
+// run-length data one from 64K samples is usually within a few percent.
+// Returns false if out of memory.
+bool scb_estimate_input(const uint8_t* key, const uint8_t* ptx,
+                        const size_t len, const size_t max_count,
+                        const size_t max_hash, const size_t samples,
+                        const size_t threads, scb_estimate* est);
+
+// Merges the `n` decryption states `parts` (of the same kind, none with a
+// budget, NULL for empty) into `*mem` (the same, or NULL), e.g. those of
+// shards decrypted on their own, so that decryption can go on from all of
+// them. Where several have an entry for a hash, the earliest wins: that of
+// `*mem`, then that of the first part with one. The merged state replaces
+// `*mem` (in memory, and made as a whole, over `threads` threads, zero
+// meaning one per processor), while the parts are left as they are (for
+// states without copies, the blocks of all of them must stay in place).
+// Returns false, changing nothing, if the states are not decryption states
+// of the same kind or have a budget, or if out of memory.
+bool scb_state_merge(scb_state* mem, scb_state* parts, const size_t n,
+                     const size_t threads);
+
+// Writes the entries of the encryption state `mem` for the blocks of the
+// `len` bytes (a multiple of 16) of `ptx`, which were the last ones encrypted
+// with it, or applies entries written this way to `*mem` (created if NULL).
+// Applied in order to the state from before `ptx`, they give the state after
+// it, so a series of them checkpoints an encryption at every step. Saving
+// costs one block hash per block, and returns false (writing nothing) if a
+// block has no entry in `mem` or if out of memory.
+bool scb_state_save_delta(scb_state mem, const uint8_t* ptx, const size_t len,
+                          const size_t max_hash, FILE* f);
+bool scb_state_load_delta(scb_state* mem, FILE* f);
+
 #endif
\ No newline at end of file
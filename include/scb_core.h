@@ -0,0 +1,114 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Block-level building blocks of SCB shared by the engines in src/. Not part
+// of the public API.
+
+#ifndef SCB_CORE_H
+#define SCB_CORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "scb.h"
+
+typedef struct hash_to_count { size_t hash; size_t count; } hash_to_count;
+typedef struct hash_to_block { size_t hash; uint8_t* block; } hash_to_block;
+typedef struct hash_to_copy { size_t hash; uint8_t block[16]; } hash_to_copy;
+typedef struct hash_to_index { size_t hash; size_t index; } hash_to_index;
+
+int compare_int(const void* in0, const void* in1, void* udata);
+uint64_t hash_int(const void* item, uint64_t seed0, uint64_t seed1);
+
+// Kinds of states, tagged on their maps (see hashmap_tag) since entries of
+// different kinds may have the same size. Encryption states keep the
+// default tag.
+typedef enum state_kind
+{
+    STATE_COUNTS, STATE_BLOCKS, STATE_COPIES
+} state_kind;
+
+// Creates an empty state of the given kind (not one with a budget).
+struct hashmap* state_new(const state_kind kind);
+
+void block_encode(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx);
+void block_decode(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx);
+void block_hash(const uint8_t* in, uint8_t* out);
+size_t bytes_to_int(const uint8_t* in, const size_t max);
+void block_xor(const uint8_t* in0, const uint8_t* in1, uint8_t* out);
+
+// Turns the block hash `hash_` into the pad of a repeat block with the given
+// count, and XORs it with the key into `out` (which may alias `hash_`).
+void block_pad(const uint8_t* key, uint8_t* hash_, const size_t count,
+               const size_t max_count, const size_t max_hash, uint8_t* out);
+
+// Tells whether the decoded block `ptx` is a repeat block, and stores its
+// referenced hash (if it is) in `hash`.
+bool block_classify(const uint8_t* key, const uint8_t* ptx,
+                    const size_t max_count, const size_t max_hash,
+                    size_t* hash);
+
+// Look up and store first occurrences in a decryption state, whose elements
+// are hash_to_copy if `copy` and hash_to_block otherwise.
+const uint8_t* state_block(struct hashmap* mem, const size_t hash,
+                           const bool copy);
+void state_store(struct hashmap* mem, const size_t hash, uint8_t* block,
+                 const bool copy);
+
+// Decryption states of copies created by scb_state_new_budget carry their
+// budget as user data of the map. Looking a block up marks it as recently
+// used, storing one may evict the least recently used, and `budget_evicted`
+// tells (and counts) whether a repeat block refers to an evicted one.
+typedef struct state_budget state_budget;
+const uint8_t* budget_block(struct hashmap* mem, state_budget* b,
+                            const size_t hash);
+void budget_store(struct hashmap* mem, state_budget* b, const size_t hash,
+                  const uint8_t* block);
+bool budget_evicted(state_budget* b, const size_t hash);
+
+// Peak memory of a state table with `entries` entries of `elsize` bytes
+// (while it last grew), and the smallest budget of scb_state_new_budget that
+// holds `entries` blocks without evicting any.
+size_t state_table_bytes(const size_t entries, const size_t elsize);
+size_t state_budget_bytes(const size_t entries);
+
+// scb_block_decrypt on either kind of state, returning whether the block
+// was stored as a first occurrence.
+bool block_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                   const size_t max_count, const size_t max_hash,
+                   scb_state* mem, const bool copy);
+
+void scb_block_encrypt(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                       const size_t max_count, const size_t max_hash,
+                       scb_state* mem);
+void scb_block_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                       const size_t max_count, const size_t max_hash,
+                       scb_state* mem);
+
+// Process the last block of a message of `len` bytes (with ciphertext
+// stealing if `len` is not a multiple of 16), once all the previous full
+// blocks have been processed.
+void scb_encrypt_last(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem);
+void scb_decrypt_last(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem);
+
+// scb_decrypt_last for a state of copies. Processes the last two blocks,
+// since a partial last block needs to know whether the one before it was
+// stored (only the last one if `len` is 16).
+void scb_decrypt_last_copy(const uint8_t* key, const uint8_t* ctx,
+                           uint8_t* ptx, const size_t len,
+                           const size_t max_count, const size_t max_hash,
+                           scb_state* mem);
+
+// Stable LSD radix sort of `n` pairs by hash. Returns false, leaving them
+// as they are, if out of memory. sort_pairs_with takes `n` pairs of scratch
+// space instead, and cannot fail.
+bool sort_pairs(hash_to_index* pairs, const size_t n);
+void sort_pairs_with(hash_to_index* pairs, hash_to_index* tmp, const size_t n);
+
+#endif
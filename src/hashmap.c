@@ -28,10 +28,34 @@ void hashmap_set_allocator(void *(*malloc)(size_t), void (*free)(void*))
 }
 
 struct bucket {
-    uint64_t hash:48;
+    uint64_t hash:40;
+    uint64_t gen:8; // Buckets of older generations are empty
     uint64_t dib:16;
 };
 
+// snapshot keeps what is needed to roll a map back to an earlier point:
+// the groups of buckets as they were before they were first changed, or,
+// once the map has moved to new buckets, the old buckets as a whole.
+struct snapshot {
+    size_t count;
+    size_t cap;
+    size_t nbuckets;
+    size_t mask;
+    size_t growat;
+    size_t shrinkat;
+    uint8_t gen;
+    size_t group;      // Buckets per group
+    uint8_t *saved;    // Bit per group, set once the group is in the log
+    uint8_t *log;      // Group index followed by the group's buckets
+    size_t nlog;
+    size_t caplog;
+    bool moved;        // The buckets below are the old ones
+    void *buckets;
+    void (*release)(void *arg);
+    void *release_arg;
+    bool lost;         // Out of memory while keeping the snapshot
+};
+
 // hashmap is an open addressed hash map using robinhood hashing.
 struct hashmap {
     void *(*malloc)(size_t);
@@ -46,6 +70,7 @@ struct hashmap {
     int (*compare)(const void *a, const void *b, void *udata);
     void (*elfree)(void *item);
     void *udata;
+    int tag;     // Set by the user, see hashmap_tag
     size_t bucketsz;
     size_t nbuckets;
     size_t count;
@@ -55,8 +80,26 @@ struct hashmap {
     void *buckets;
     void *spare;
     void *edata;
+    void (*release)(void *arg); // Set if the buckets are not owned
+    void *release_arg;
+    bool zeroed; // The allocator returns zeroed memory
+    uint8_t gen; // Generation of the buckets in use
+    struct snapshot *snap; // Set between hashmap_snapshot and commit/rollback
+    bool incremental;   // Grow by moving a few buckets per hashmap_set
+    void *old;          // Buckets still being moved from, or NULL
+    size_t old_nbuckets;
+    size_t old_mask;
+    size_t old_next;    // Buckets before this one have been moved
+    uint8_t old_gen;
+    void (*old_release)(void *arg);
+    void *old_release_arg;
 };
 
+// Buckets of the old array moved by each hashmap_set while growing
+// incrementally. Growing from n buckets takes n/HASHMAP_MOVE insertions,
+// long before the new array (of 2n) is 3/4 full again.
+#define HASHMAP_MOVE 4
+
 static struct bucket *bucket_at(struct hashmap *map, size_t index) {
     return (struct bucket*)(((char*)map->buckets)+(map->bucketsz*index));
 }
@@ -65,29 +108,221 @@ static void *bucket_item(struct bucket *entry) {
     return ((char*)entry)+sizeof(struct bucket);
 }
 
+// bucket_dib returns the dib of a bucket, or 0 if it is empty.
+static size_t bucket_dib(struct hashmap *map, struct bucket *bucket) {
+    return bucket->gen == map->gen ? bucket->dib : 0;
+}
+
 static uint64_t get_hash(struct hashmap *map, const void *key) {
-    return map->hash(key, map->seed0, map->seed1) << 16 >> 16;
+    return map->hash(key, map->seed0, map->seed1) << 24 >> 24;
 }
 
-// hashmap_new_with_allocator returns a new hash map using a custom allocator.
-// See hashmap_new for more information information
-struct hashmap *hashmap_new_with_allocator(
-                            void *(*_malloc)(size_t), 
-                            void *(*_realloc)(void*, size_t), 
-                            void (*_free)(void*),
-                            size_t elsize, size_t cap, 
-                            uint64_t seed0, uint64_t seed1,
-                            uint64_t (*hash)(const void *item, 
-                                             uint64_t seed0, uint64_t seed1),
-                            int (*compare)(const void *a, const void *b, 
-                                           void *udata),
-                            void (*elfree)(void *item),
-                            void *udata)
+static void free_buckets(struct hashmap *map) {
+    if (map->release) {
+        map->release(map->release_arg);
+        map->release = NULL;
+    } else {
+        map->free(map->buckets);
+    }
+}
+
+// drop_buckets is free_buckets for buckets about to be replaced, which are
+// kept instead if they are those of a snapshot.
+static void drop_buckets(struct hashmap *map) {
+    struct snapshot *snap = map->snap;
+    if (!snap || snap->moved) {
+        free_buckets(map);
+        return;
+    }
+    snap->moved = true;
+    snap->buckets = map->buckets;
+    snap->release = map->release;
+    snap->release_arg = map->release_arg;
+    map->release = NULL;
+}
+
+// place inserts an entry known not to be in the map into its buckets,
+// without counting it. The entry is overwritten.
+static void place(struct hashmap *map, struct bucket *entry) {
+    entry->gen = map->gen;
+    entry->dib = 1;
+    size_t i = entry->hash & map->mask;
+    for (;;) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket_dib(map, bucket) == 0) {
+            memcpy(bucket, entry, map->bucketsz);
+            return;
+        }
+        if (bucket_dib(map, bucket) < entry->dib) {
+            memcpy(map->spare, bucket, map->bucketsz);
+            memcpy(bucket, entry, map->bucketsz);
+            memcpy(entry, map->spare, map->bucketsz);
+        }
+        i = (i + 1) & map->mask;
+        entry->dib += 1;
+    }
+}
+
+static struct bucket *old_at(struct hashmap *map, size_t index) {
+    return (struct bucket*)(((char*)map->old)+(map->bucketsz*index));
+}
+
+// move_old moves up to n buckets from the old array to the current one,
+// releasing the old array once all are moved.
+static void move_old(struct hashmap *map, size_t n) {
+    for (; n > 0 && map->old_next < map->old_nbuckets; n--) {
+        struct bucket *bucket = old_at(map, map->old_next++);
+        if (bucket->gen == map->old_gen && bucket->dib) {
+            memcpy(map->edata, bucket, map->bucketsz);
+            place(map, map->edata);
+        }
+    }
+    if (map->old_next == map->old_nbuckets) {
+        if (map->old_release) {
+            map->old_release(map->old_release_arg);
+        } else {
+            map->free(map->old);
+        }
+        map->old = NULL;
+    }
+}
+
+static void finish_move(struct hashmap *map) {
+    if (map->old) {
+        move_old(map, map->old_nbuckets);
+    }
+}
+
+// drop_old releases the old array without moving what is left in it.
+static void drop_old(struct hashmap *map) {
+    if (map->old) {
+        map->old_next = map->old_nbuckets;
+        move_old(map, 0);
+    }
+}
+
+// grow doubles the buckets incrementally: the current ones become the old
+// array, to be moved by the following calls to hashmap_set.
+static bool grow(struct hashmap *map) {
+    finish_move(map);
+    size_t nbuckets = map->nbuckets*2;
+    void *buckets;
+    if (map->malloc == malloc) {
+        // Large blocks come zeroed from the system, a page at a time as
+        // they are first used, so that growing does not clear them at once.
+        buckets = calloc(nbuckets, map->bucketsz);
+    } else {
+        buckets = map->malloc(map->bucketsz*nbuckets);
+        if (buckets && !map->zeroed) {
+            memset(buckets, 0, map->bucketsz*nbuckets);
+        }
+    }
+    if (!buckets) {
+        return false;
+    }
+    map->old = map->buckets;
+    map->old_nbuckets = map->nbuckets;
+    map->old_mask = map->mask;
+    map->old_next = 0;
+    map->old_gen = map->gen;
+    map->old_release = map->release;
+    map->old_release_arg = map->release_arg;
+    map->release = NULL;
+    map->buckets = buckets;
+    map->nbuckets = nbuckets;
+    map->mask = nbuckets-1;
+    map->gen = 0;
+    map->growat = nbuckets*0.75;
+    map->shrinkat = nbuckets*0.10;
+    return true;
+}
+
+// old_find returns the bucket of the old array that still holds key, or
+// NULL. Buckets already moved stay as they were, so that the runs of
+// those not yet moved are not broken, but no longer count.
+static struct bucket *old_find(struct hashmap *map, const void *key,
+                               uint64_t hash)
+{
+    size_t i = hash & map->old_mask;
+    for (;;) {
+        struct bucket *bucket = old_at(map, i);
+        if (bucket->gen != map->old_gen || !bucket->dib) {
+            return NULL;
+        }
+        if (i >= map->old_next && bucket->hash == hash &&
+            map->compare(key, bucket_item(bucket), map->udata) == 0)
+        {
+            return bucket;
+        }
+        i = (i + 1) & map->old_mask;
+    }
+}
+
+// touch_group saves the group of the bucket at index to the snapshot log,
+// unless it has already been saved. Returns false if out of memory.
+static bool touch_group(struct hashmap *map, size_t index) {
+    struct snapshot *snap = map->snap;
+    size_t g = index / snap->group;
+    if (snap->moved || (snap->saved[g/8] & (1 << (g%8)))) {
+        return true;
+    }
+    size_t groupsz = map->bucketsz*snap->group;
+    size_t entrysz = sizeof(size_t)+groupsz;
+    if (snap->nlog == snap->caplog) {
+        // Not realloc, which custom allocators may not provide.
+        size_t caplog = snap->caplog ? snap->caplog*2 : 16;
+        uint8_t *log = map->malloc(entrysz*caplog);
+        if (!log) {
+            return false;
+        }
+        if (snap->log) {
+            memcpy(log, snap->log, entrysz*snap->nlog);
+            map->free(snap->log);
+        }
+        snap->log = log;
+        snap->caplog = caplog;
+    }
+    uint8_t *entry = snap->log+entrysz*snap->nlog++;
+    size_t n = map->nbuckets-g*snap->group;
+    memcpy(entry, &g, sizeof(size_t));
+    memcpy(entry+sizeof(size_t), bucket_at(map, g*snap->group),
+           map->bucketsz*(n < snap->group ? n : snap->group));
+    snap->saved[g/8] |= 1 << (g%8);
+    return true;
+}
+
+// touch_run saves the groups of the run of buckets starting at index, up
+// to and including the first empty bucket, which are all those an insertion
+// or a deletion starting there may change.
+static bool touch_run(struct hashmap *map, size_t index) {
+    for (size_t i = index;; i = (i + 1) & map->mask) {
+        if ((i == index || i % map->snap->group == 0) && 
+            !touch_group(map, i))
+        {
+            return false;
+        }
+        if (!bucket_dib(map, bucket_at(map, i))) {
+            return true;
+        }
+    }
+}
+
+static struct hashmap *new_map(void *(*_malloc)(size_t), 
+                               void *(*_realloc)(void*, size_t), 
+                               void (*_free)(void*), bool zeroed,
+                               size_t elsize, size_t cap, 
+                               uint64_t seed0, uint64_t seed1,
+                               uint64_t (*hash)(const void *item, 
+                                                uint64_t seed0, uint64_t seed1),
+                               int (*compare)(const void *a, const void *b, 
+                                              void *udata),
+                               void (*elfree)(void *item),
+                               void *udata)
 {
     _malloc = _malloc ? _malloc : malloc;
     _realloc = _realloc ? _realloc : realloc;
     _free = _free ? _free : free;
-    int ncap = 16;
+    size_t ncap = 16;
     if (cap < ncap) {
         cap = ncap;
     } else {
@@ -125,15 +360,58 @@ struct hashmap *hashmap_new_with_allocator(
         _free(map);
         return NULL;
     }
-    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+    if (!zeroed) {
+        memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+    }
     map->growat = map->nbuckets*0.75;
     map->shrinkat = map->nbuckets*0.10;
     map->malloc = _malloc;
     map->realloc = _realloc;
     map->free = _free;
+    map->zeroed = zeroed;
     return map;  
 }
 
+// hashmap_new_with_allocator returns a new hash map using a custom allocator.
+// See hashmap_new for more information information
+struct hashmap *hashmap_new_with_allocator(
+                            void *(*_malloc)(size_t), 
+                            void *(*_realloc)(void*, size_t), 
+                            void (*_free)(void*),
+                            size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    return new_map(_malloc, _realloc, _free, false, elsize, cap, seed0, seed1,
+                   hash, compare, elfree, udata);
+}
+
+// hashmap_new_with_zeroed_allocator is like hashmap_new_with_allocator, for
+// an allocator that returns zeroed memory (such as fresh mappings of sparse
+// files), so that new buckets are not cleared, and untouched ones never
+// need to be backed by memory.
+struct hashmap *hashmap_new_with_zeroed_allocator(
+                            void *(*_malloc)(size_t), 
+                            void *(*_realloc)(void*, size_t), 
+                            void (*_free)(void*),
+                            size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    return new_map(_malloc, _realloc, _free, true, elsize, cap, seed0, seed1,
+                   hash, compare, elfree, udata);
+}
+
 
 // hashmap_new returns a new hash map. 
 // Param `elsize` is the size of each element in the tree. Every element that
@@ -171,9 +449,10 @@ struct hashmap *hashmap_new(size_t elsize, size_t cap,
 
 static void free_elements(struct hashmap *map) {
     if (map->elfree) {
+        finish_move(map);
         for (size_t i = 0; i < map->nbuckets; i++) {
             struct bucket *bucket = bucket_at(map, i);
-            if (bucket->dib) map->elfree(bucket_item(bucket));
+            if (bucket_dib(map, bucket)) map->elfree(bucket_item(bucket));
         }
     }
 }
@@ -188,17 +467,29 @@ static void free_elements(struct hashmap *map) {
 void hashmap_clear(struct hashmap *map, bool update_cap) {
     map->count = 0;
     free_elements(map);
+    drop_old(map);
     if (update_cap) {
         map->cap = map->nbuckets;
     } else if (map->nbuckets != map->cap) {
         void *new_buckets = map->malloc(map->bucketsz*map->cap);
         if (new_buckets) {
-            map->free(map->buckets);
+            drop_buckets(map);
             map->buckets = new_buckets;
         }
         map->nbuckets = map->cap;
     }
+    if (map->snap && !map->snap->moved) {
+        // Clear new buckets rather than those of the snapshot.
+        void *new_buckets = map->malloc(map->bucketsz*map->nbuckets);
+        if (new_buckets) {
+            drop_buckets(map);
+            map->buckets = new_buckets;
+        } else {
+            map->snap->lost = true;
+        }
+    }
     memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+    map->gen = 0;
     map->mask = map->nbuckets-1;
     map->growat = map->nbuckets*0.75;
     map->shrinkat = map->nbuckets*0.10;
@@ -206,17 +497,20 @@ void hashmap_clear(struct hashmap *map, bool update_cap) {
 
 
 static bool resize(struct hashmap *map, size_t new_cap) {
-    struct hashmap *map2 = hashmap_new(map->elsize, new_cap, map->seed1, 
-                                       map->seed1, map->hash, map->compare,
-                                       map->elfree, map->udata);
+    finish_move(map);
+    struct hashmap *map2 = new_map(map->malloc, map->realloc, map->free,
+                                   map->zeroed, map->elsize, new_cap,
+                                   map->seed0, map->seed1, map->hash,
+                                   map->compare, map->elfree, map->udata);
     if (!map2) {
         return false;
     }
     for (size_t i = 0; i < map->nbuckets; i++) {
         struct bucket *entry = bucket_at(map, i);
-        if (!entry->dib) {
+        if (!bucket_dib(map, entry)) {
             continue;
         }
+        entry->gen = map2->gen;
         entry->dib = 1;
         size_t j = entry->hash & map2->mask;
         for (;;) {
@@ -234,12 +528,13 @@ static bool resize(struct hashmap *map, size_t new_cap) {
             entry->dib += 1;
         }
 	}
-    map->free(map->buckets);
+    drop_buckets(map);
     map->buckets = map2->buckets;
     map->nbuckets = map2->nbuckets;
     map->mask = map2->mask;
     map->growat = map2->growat;
     map->shrinkat = map2->shrinkat;
+    map->gen = map2->gen;
     map->free(map2);
     return true;
 }
@@ -254,22 +549,40 @@ void *hashmap_set(struct hashmap *map, const void *item) {
     }
     map->oom = false;
     if (map->count == map->growat) {
-        if (!resize(map, map->nbuckets*2)) {
+        // Snapshots keep the old buckets as they are, so they grow at once.
+        if (!(map->incremental && !map->snap ? grow(map) :
+                                              resize(map, map->nbuckets*2))) {
             map->oom = true;
             return NULL;
         }
     }
-
+    if (map->old) {
+        move_old(map, HASHMAP_MOVE);
+    }
+    if (map->old) {
+        // An item not moved yet is replaced where it is.
+        struct bucket *bucket = old_find(map, item, get_hash(map, item));
+        if (bucket) {
+            memcpy(map->spare, bucket_item(bucket), map->elsize);
+            memcpy(bucket_item(bucket), item, map->elsize);
+            return map->spare;
+        }
+    }
     
     struct bucket *entry = map->edata;
     entry->hash = get_hash(map, item);
+    entry->gen = map->gen;
     entry->dib = 1;
     memcpy(bucket_item(entry), item, map->elsize);
     
     size_t i = entry->hash & map->mask;
+    if (map->snap && !touch_run(map, i)) {
+        map->oom = true;
+        return NULL;
+    }
 	for (;;) {
         struct bucket *bucket = bucket_at(map, i);
-        if (bucket->dib == 0) {
+        if (bucket_dib(map, bucket) == 0) {
             memcpy(bucket, entry, map->bucketsz);
             map->count++;
 			return NULL;
@@ -282,7 +595,7 @@ void *hashmap_set(struct hashmap *map, const void *item) {
             memcpy(bucket_item(bucket), bucket_item(entry), map->elsize);
             return map->spare;
 		}
-        if (bucket->dib < entry->dib) {
+        if (bucket_dib(map, bucket) < entry->dib) {
             memcpy(map->spare, bucket, map->bucketsz);
             memcpy(bucket, entry, map->bucketsz);
             memcpy(entry, map->spare, map->bucketsz);
@@ -302,8 +615,8 @@ void *hashmap_get(struct hashmap *map, const void *key) {
 	size_t i = hash & map->mask;
 	for (;;) {
         struct bucket *bucket = bucket_at(map, i);
-		if (!bucket->dib) {
-			return NULL;
+		if (!bucket_dib(map, bucket)) {
+			break;
 		}
 		if (bucket->hash == hash && 
             map->compare(key, bucket_item(bucket), map->udata) == 0)
@@ -312,15 +625,18 @@ void *hashmap_get(struct hashmap *map, const void *key) {
 		}
 		i = (i + 1) & map->mask;
 	}
+    struct bucket *bucket = map->old ? old_find(map, key, hash) : NULL;
+    return bucket ? bucket_item(bucket) : NULL;
 }
 
 // hashmap_probe returns the item in the bucket at position or NULL if an item
 // is not set for that bucket. The position is 'moduloed' by the number of 
 // buckets in the hashmap.
 void *hashmap_probe(struct hashmap *map, uint64_t position) {
+    finish_move(map);
     size_t i = position & map->mask;
     struct bucket *bucket = bucket_at(map, i);
-    if (!bucket->dib) {
+    if (!bucket_dib(map, bucket)) {
 		return NULL;
 	}
     return bucket_item(bucket);
@@ -334,23 +650,28 @@ void *hashmap_delete(struct hashmap *map, void *key) {
         panic("key is null");
     }
     map->oom = false;
+    finish_move(map);
     uint64_t hash = get_hash(map, key);
 	size_t i = hash & map->mask;
 	for (;;) {
         struct bucket *bucket = bucket_at(map, i);
-		if (!bucket->dib) {
+		if (!bucket_dib(map, bucket)) {
 			return NULL;
 		}
 		if (bucket->hash == hash && 
             map->compare(key, bucket_item(bucket), map->udata) == 0)
         {
+            if (map->snap && !touch_run(map, i)) {
+                map->oom = true;
+                return NULL;
+            }
             memcpy(map->spare, bucket_item(bucket), map->elsize);
             bucket->dib = 0;
             for (;;) {
                 struct bucket *prev = bucket;
                 i = (i + 1) & map->mask;
                 bucket = bucket_at(map, i);
-                if (bucket->dib <= 1) {
+                if (bucket_dib(map, bucket) <= 1) {
                     prev->dib = 0;
                     break;
                 }
@@ -381,10 +702,173 @@ size_t hashmap_count(struct hashmap *map) {
 void hashmap_free(struct hashmap *map) {
     if (!map) return;
     free_elements(map);
-    map->free(map->buckets);
+    free_buckets(map);
+    drop_old(map);
+    hashmap_commit(map);
     map->free(map);
 }
 
+// hashmap_reset removes all items like hashmap_clear(map, true), but in
+// constant time, by moving on to a new generation of buckets, which leaves
+// the buckets of older generations empty. They are only actually cleared
+// once every 256 generations (or every time if items need to be freed).
+void hashmap_reset(struct hashmap *map) {
+    if (map->elfree || map->gen == UINT8_MAX) {
+        hashmap_clear(map, true);
+        return;
+    }
+    drop_old(map);
+    map->gen++;
+    map->count = 0;
+    map->cap = map->nbuckets;
+}
+
+// hashmap_snapshot records the current content of the map, so that it can
+// be restored by hashmap_rollback (or forgotten by hashmap_commit). Taking
+// it costs no more than clearing a bit per group of buckets. Afterwards,
+// the first change to a group of buckets (about a page) saves a copy of it,
+// and a resize keeps the old buckets, so that rolling back costs no more
+// than the changes made. There is at most one snapshot at a time, and items
+// must not be changed in place meanwhile. Returns false if out of memory or
+// if there already is a snapshot.
+bool hashmap_snapshot(struct hashmap *map) {
+    if (map->snap) {
+        return false;
+    }
+    finish_move(map);
+    struct snapshot *snap = map->malloc(sizeof(struct snapshot));
+    if (!snap) {
+        return false;
+    }
+    memset(snap, 0, sizeof(struct snapshot));
+    snap->group = 4096/map->bucketsz ? 4096/map->bucketsz : 1;
+    size_t ngroups = (map->nbuckets+snap->group-1)/snap->group;
+    snap->saved = map->malloc((ngroups+7)/8);
+    if (!snap->saved) {
+        map->free(snap);
+        return false;
+    }
+    memset(snap->saved, 0, (ngroups+7)/8);
+    snap->count = map->count;
+    snap->cap = map->cap;
+    snap->nbuckets = map->nbuckets;
+    snap->mask = map->mask;
+    snap->growat = map->growat;
+    snap->shrinkat = map->shrinkat;
+    snap->gen = map->gen;
+    map->snap = snap;
+    return true;
+}
+
+// hashmap_commit forgets the snapshot of the map, if any.
+void hashmap_commit(struct hashmap *map) {
+    struct snapshot *snap = map->snap;
+    if (!snap) {
+        return;
+    }
+    if (snap->moved) {
+        if (snap->release) {
+            snap->release(snap->release_arg);
+        } else {
+            map->free(snap->buckets);
+        }
+    }
+    map->free(snap->saved);
+    map->free(snap->log);
+    map->free(snap);
+    map->snap = NULL;
+}
+
+// hashmap_rollback restores the map to its snapshot, which it then forgets.
+// Returns false (leaving the map as it is) if there is no snapshot, or if
+// it was lost for lack of memory.
+bool hashmap_rollback(struct hashmap *map) {
+    struct snapshot *snap = map->snap;
+    if (!snap || snap->lost) {
+        hashmap_commit(map);
+        return false;
+    }
+    if (snap->moved) {
+        free_buckets(map);
+        map->buckets = snap->buckets;
+        map->release = snap->release;
+        map->release_arg = snap->release_arg;
+        snap->moved = false;
+    }
+    map->count = snap->count;
+    map->cap = snap->cap;
+    map->nbuckets = snap->nbuckets;
+    map->mask = snap->mask;
+    map->growat = snap->growat;
+    map->shrinkat = snap->shrinkat;
+    map->gen = snap->gen;
+    size_t groupsz = map->bucketsz*snap->group;
+    for (size_t i = 0; i < snap->nlog; i++) {
+        uint8_t *entry = snap->log+(sizeof(size_t)+groupsz)*i;
+        size_t g;
+        memcpy(&g, entry, sizeof(size_t));
+        size_t n = map->nbuckets-g*snap->group;
+        memcpy(bucket_at(map, g*snap->group), entry+sizeof(size_t),
+               map->bucketsz*(n < snap->group ? n : snap->group));
+    }
+    hashmap_commit(map);
+    return true;
+}
+
+// hashmap_clone returns a new hash map with the same items, allocated the
+// same way as `map`, or NULL if out of memory.
+struct hashmap *hashmap_clone(struct hashmap *map) {
+    finish_move(map);
+    struct hashmap *map2 = new_map(map->malloc, map->realloc, map->free,
+                                   map->zeroed, map->elsize, map->nbuckets,
+                                   map->seed0, map->seed1, map->hash,
+                                   map->compare, map->elfree, map->udata);
+    if (!map2) {
+        return NULL;
+    }
+    memcpy(map2->buckets, map->buckets, map->bucketsz*map->nbuckets);
+    map2->count = map->count;
+    map2->cap = map->cap;
+    map2->gen = map->gen;
+    map2->incremental = map->incremental;
+    map2->tag = map->tag;
+    return map2;
+}
+
+// hashmap_set_incremental sets whether the map grows incrementally: rather
+// than moving all items to twice as many buckets at once, it then moves a
+// few of them per hashmap_set, looking items up in both meanwhile, so that
+// no single call takes long. Operations other than hashmap_get and
+// hashmap_set (and turning it off) first move what is left.
+void hashmap_set_incremental(struct hashmap *map, bool incremental) {
+    map->incremental = incremental;
+    if (!incremental) {
+        finish_move(map);
+    }
+}
+
+// hashmap_udata returns the user data given in hashmap_new.
+void *hashmap_udata(struct hashmap *map) {
+    return map->udata;
+}
+
+// hashmap_tag returns the tag set with hashmap_set_tag (0 until then), which
+// clones keep, e.g. to tell apart maps of different kinds of items of the
+// same size.
+int hashmap_tag(struct hashmap *map) {
+    return map->tag;
+}
+
+void hashmap_set_tag(struct hashmap *map, int tag) {
+    map->tag = tag;
+}
+
+// hashmap_snapshotted returns true between hashmap_snapshot and
+// hashmap_commit or hashmap_rollback.
+bool hashmap_snapshotted(struct hashmap *map) {
+    return map->snap != NULL;
+}
+
 // hashmap_oom returns true if the last hashmap_set() call failed due to the 
 // system being out of memory.
 bool hashmap_oom(struct hashmap *map) {
@@ -397,9 +881,10 @@ bool hashmap_oom(struct hashmap *map) {
 bool hashmap_scan(struct hashmap *map, 
                   bool (*iter)(const void *item, void *udata), void *udata)
 {
+    finish_move(map);
     for (size_t i = 0; i < map->nbuckets; i++) {
         struct bucket *bucket = bucket_at(map, i);
-        if (bucket->dib) {
+        if (bucket_dib(map, bucket)) {
             if (!iter(bucket_item(bucket), udata)) {
                 return false;
             }
@@ -409,6 +894,113 @@ bool hashmap_scan(struct hashmap *map,
 }
 
 
+// hashmap_buckets returns the bucket array of the map, which holds the items
+// without any pointers, along with the number of buckets and the size of
+// each, so that it can be saved and later passed to hashmap_new_with_buckets.
+// After a hashmap_reset, this first clears the buckets of older generations
+// (unless there is a snapshot, and then the buckets may not be saved).
+void *hashmap_buckets(struct hashmap *map, size_t *nbuckets, size_t *bucketsz)
+{
+    finish_move(map);
+    if (map->gen != 0 && !map->snap) {
+        for (size_t i = 0; i < map->nbuckets; i++) {
+            struct bucket *bucket = bucket_at(map, i);
+            if (!bucket_dib(map, bucket)) {
+                bucket->dib = 0;
+            }
+            bucket->gen = 0;
+        }
+        map->gen = 0;
+    }
+    *nbuckets = map->nbuckets;
+    *bucketsz = map->bucketsz;
+    return map->buckets;
+}
+
+// hashmap_new_with_buckets returns a new hash map like hashmap_new, working
+// directly on the `nbuckets` buckets holding `count` items, as returned by
+// hashmap_buckets for a map with the same element size and hash function
+// (e.g. mapped from a file). The buckets are not freed by the map. Instead,
+// `release` is called with `arg` once the map has been freed or has moved
+// its items to buckets of its own.
+struct hashmap *hashmap_new_with_buckets(size_t elsize, void *buckets,
+                            size_t nbuckets, size_t count,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata,
+                            void (*release)(void *arg), void *arg)
+{
+    if (nbuckets < 16 || (nbuckets & (nbuckets-1))) {
+        return NULL;
+    }
+    struct hashmap *map = hashmap_new(elsize, 0, seed0, seed1, hash, compare,
+                                      elfree, udata);
+    if (!map) {
+        return NULL;
+    }
+    map->free(map->buckets);
+    map->buckets = buckets;
+    map->nbuckets = nbuckets;
+    map->count = count;
+    map->mask = nbuckets-1;
+    map->growat = nbuckets*0.75;
+    map->shrinkat = nbuckets*0.10;
+    map->release = release;
+    map->release_arg = arg;
+    return map;
+}
+
+// hashmap_hash returns the hash the map uses for `item`. Taken modulo the
+// number of buckets, it gives the bucket where the search for it starts.
+uint64_t hashmap_hash(struct hashmap *map, const void *item) {
+    return get_hash(map, item);
+}
+
+// hashmap_place bulk loads items: it puts the `n` items, sorted by their
+// hash modulo the number of buckets (the capacity of a new map, rounded up
+// to a power of two of at least 16) and with keys that are neither in the map nor repeated,
+// each into the first empty bucket from its position on, in a single sweep,
+// as long as that bucket comes before bucket `end`. It returns how many
+// items were placed; the rest must be added with hashmap_set. Placed items
+// are only counted once hashmap_placed is called with their total, so that
+// calls sweeping disjoint ranges of buckets may run concurrently. Not for a
+// map with a snapshot or an incremental resize going on.
+size_t hashmap_place(struct hashmap *map, const void *const *items, size_t n,
+                     size_t end)
+{
+    if (end > map->nbuckets) {
+        end = map->nbuckets;
+    }
+    size_t next = 0;
+    for (size_t j = 0; j < n; j++) {
+        uint64_t hash = get_hash(map, items[j]);
+        size_t home = hash & map->mask;
+        size_t i = home < next ? next : home;
+        while (i < end && bucket_dib(map, bucket_at(map, i))) {
+            i++;
+        }
+        if (i >= end || i - home >= UINT16_MAX) {
+            return j;
+        }
+        struct bucket *bucket = bucket_at(map, i);
+        bucket->hash = hash;
+        bucket->gen = map->gen;
+        bucket->dib = i - home + 1;
+        memcpy(bucket_item(bucket), items[j], map->elsize);
+        next = i + 1;
+    }
+    return n;
+}
+
+// hashmap_placed counts `count` items placed by hashmap_place.
+void hashmap_placed(struct hashmap *map, size_t count) {
+    map->count += count;
+}
+
 // hashmap_iter iterates one key at a time yielding a reference to an
 // entry at each iteration. Useful to write simple loops and avoid writing
 // dedicated callbacks and udata structures, as in hashmap_scan.
@@ -431,12 +1023,13 @@ bool hashmap_iter(struct hashmap *map, size_t *i, void **item)
 {
     struct bucket *bucket;
 
+    finish_move(map);
     do {
         if (*i >= map->nbuckets) return false;
 
         bucket = bucket_at(map, *i);
         (*i)++;
-    } while (!bucket->dib);
+    } while (!bucket_dib(map, bucket));
 
     *item = bucket_item(bucket);
 
@@ -621,7 +1214,7 @@ uint64_t hashmap_murmur(const void *data, size_t len,
 static size_t deepcount(struct hashmap *map) {
     size_t count = 0;
     for (size_t i = 0; i < map->nbuckets; i++) {
-        if (bucket_at(map, i)->dib) {
+        if (bucket_dib(map, bucket_at(map, i))) {
             count++;
         }
     }
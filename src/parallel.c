@@ -0,0 +1,344 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Work-stealing pool. Every worker has a deque of tasks, taking the newest
+// of its own and stealing the oldest of the others, and threads from outside
+// the pool share one more deque. A thread waiting for its tasks runs any
+// task it finds meanwhile, so that parallel work within parallel work runs
+// on the same threads rather than starting new ones.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "compat.h"
+#include "parallel.h"
+#include "scb.h"
+
+typedef struct job
+{
+    void (*fn)(size_t begin, size_t end, void* udata);
+    void* udata;
+    atomic_size_t pending; // Tasks not done yet, decreased under `lock`
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} job;
+
+typedef struct task
+{
+    job* job;
+    size_t begin;
+    size_t end;
+} task;
+
+typedef struct deque
+{
+    pthread_mutex_t lock;
+    task* tasks; // Ring buffer, oldest task at `head`
+    size_t cap;
+    size_t head;
+    size_t n;
+} deque;
+
+typedef struct pool pool;
+
+typedef struct worker
+{
+    pool* pool;
+    size_t index;
+    pthread_t tid;
+} worker;
+
+struct pool
+{
+    size_t threads;  // Workers started, plus the thread waiting for a job
+    size_t workers;  // Workers asked for
+    worker* worker;
+    deque* deques;   // One per worker, then the one of outside threads
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_size_t queued;
+    atomic_size_t tasks;
+    atomic_size_t steals;
+    atomic_uint_fast64_t busy_ns;
+};
+
+static pool single = { .threads = 1 }; // If no pool can be allocated
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t pool_size = 0;
+static _Atomic(pool*) the_pool = NULL;
+static _Thread_local size_t self = SIZE_MAX; // Index of the current worker
+static _Thread_local size_t depth = 0;       // Tasks running on this thread
+static _Thread_local uint64_t blocked = 0;   // Waiting within them, in ns
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns false if out of memory.
+static bool deque_push(deque* d, const task* t)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->n == d->cap)
+    {
+        size_t cap = d->cap == 0 ? 64 : d->cap * 2;
+        task* tasks = (task*)malloc(cap * sizeof(*tasks));
+        if (tasks == NULL)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return false;
+        }
+        for (size_t i = 0; i < d->n; ++i)
+            tasks[i] = d->tasks[(d->head + i) % d->cap];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->cap = cap;
+        d->head = 0;
+    }
+    d->tasks[(d->head + d->n++) % d->cap] = *t;
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+// Takes the newest task if `newest`, else the oldest one.
+static bool deque_take(deque* d, task* t, const bool newest)
+{
+    pthread_mutex_lock(&d->lock);
+    bool found = d->n > 0;
+    if (found && newest)
+        *t = d->tasks[(d->head + --d->n) % d->cap];
+    else if (found)
+    {
+        *t = d->tasks[d->head];
+        d->head = (d->head + 1) % d->cap;
+        --d->n;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static size_t own_deque(const pool* p)
+{
+    return self < p->workers ? self : p->workers;
+}
+
+// Takes a task of the current thread, or else steals one.
+static bool find_task(pool* p, task* t)
+{
+    if (atomic_load(&p->queued) == 0)
+        return false;
+    size_t own = own_deque(p);
+    bool found = deque_take(&p->deques[own], t, true);
+    for (size_t i = 1; !found && i <= p->workers; ++i)
+    {
+        found = deque_take(&p->deques[(own + i) % (p->workers + 1)], t,
+                           false);
+        if (found)
+            atomic_fetch_add(&p->steals, 1);
+    }
+    if (found)
+        atomic_fetch_sub(&p->queued, 1);
+    return found;
+}
+
+// Runs a slice, counting the time of tasks run within it (while waiting for
+// tasks of its own) only once, and without the time it waited for others.
+static void run_slice(pool* p, void (*fn)(size_t begin, size_t end,
+                                          void* udata),
+                      const size_t begin, const size_t end, void* udata)
+{
+    uint64_t t0 = 0;
+    if (depth++ == 0)
+    {
+        blocked = 0;
+        t0 = now_ns();
+    }
+    fn(begin, end, udata);
+    if (--depth == 0)
+        atomic_fetch_add(&p->busy_ns, now_ns() - t0 - blocked);
+    atomic_fetch_add(&p->tasks, 1);
+}
+
+static void run_task(pool* p, const task* t)
+{
+    job* j = t->job;
+    run_slice(p, j->fn, t->begin, t->end, j->udata);
+
+    pthread_mutex_lock(&j->lock);
+    if (atomic_fetch_sub(&j->pending, 1) == 1)
+        pthread_cond_broadcast(&j->done);
+    pthread_mutex_unlock(&j->lock);
+}
+
+static void* worker_run(void* arg)
+{
+    worker* w = (worker*)arg;
+    pool* p = w->pool;
+    self = w->index;
+    while (true)
+    {
+        task t;
+        if (find_task(p, &t))
+        {
+            run_task(p, &t);
+            continue;
+        }
+        // Tasks are counted before the workers are woken, so none is missed.
+        pthread_mutex_lock(&p->lock);
+        while (atomic_load(&p->queued) == 0)
+            pthread_cond_wait(&p->wake, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+static size_t default_size(void)
+{
+    const char* env = getenv("SCB_THREADS");
+    size_t n;
+    if (env != NULL && sscanf(env, "%zu", &n) == 1 && n > 0)
+        return n;
+
+    long procs = sysconf(_SC_NPROCESSORS_ONLN);
+    return procs < 1 ? 1 : (size_t)procs;
+}
+
+// Returns the pool, starting it on first use.
+static pool* pool_get(void)
+{
+    pool* p = atomic_load(&the_pool);
+    if (p != NULL)
+        return p;
+
+    pthread_mutex_lock(&pool_lock);
+    p = atomic_load(&the_pool);
+    if (p == NULL)
+    {
+        size_t size = pool_size != 0 ? pool_size : default_size();
+        p = (pool*)calloc(1, sizeof(*p));
+        worker* w = (worker*)calloc(size - 1, sizeof(*w));
+        deque* d = (deque*)calloc(size, sizeof(*d));
+        if (p == NULL || (size > 1 && w == NULL) || d == NULL)
+        {
+            // Without a pool, everything runs on the calling thread.
+            free(p);
+            free(w);
+            free(d);
+            atomic_store(&the_pool, &single);
+            pthread_mutex_unlock(&pool_lock);
+            return &single;
+        }
+        p->workers = size - 1;
+        p->worker = w;
+        p->deques = d;
+        for (size_t i = 0; i <= p->workers; ++i)
+            pthread_mutex_init(&p->deques[i].lock, NULL);
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->wake, NULL);
+
+        // A worker that cannot be started leaves its deque empty for good.
+        p->threads = 1;
+        for (size_t i = 0; i < p->workers; ++i)
+        {
+            p->worker[i] = (worker){ .pool = p, .index = i };
+            if (!pthread_create(&p->worker[i].tid, NULL, worker_run,
+                                &p->worker[i]))
+            {
+                pthread_detach(p->worker[i].tid);
+                ++p->threads;
+            }
+        }
+        atomic_store(&the_pool, p);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return p;
+}
+
+bool scb_pool_init(const size_t threads)
+{
+    pthread_mutex_lock(&pool_lock);
+    bool set = atomic_load(&the_pool) == NULL;
+    if (set)
+        pool_size = threads;
+    pthread_mutex_unlock(&pool_lock);
+    return set;
+}
+
+void scb_pool_usage(scb_pool_stats* stats)
+{
+    pool* p = pool_get();
+    *stats = (scb_pool_stats){ .threads = p->threads,
+                               .tasks = atomic_load(&p->tasks),
+                               .steals = atomic_load(&p->steals),
+                               .busy = atomic_load(&p->busy_ns) * 1e-9 };
+}
+
+size_t parallel_threads(const size_t threads)
+{
+    size_t size = pool_get()->threads;
+    return threads == 0 || threads > size ? size : threads;
+}
+
+void parallel_for(const size_t threads, const size_t n,
+                  void (*fn)(size_t begin, size_t end, void* udata),
+                  void* udata)
+{
+    size_t t = parallel_threads(threads);
+    if (t > n)
+        t = n;
+    pool* p = pool_get();
+    if (t <= 1)
+    {
+        if (n > 0)
+            run_slice(p, fn, 0, n, udata);
+        return;
+    }
+
+    job j = { .fn = fn, .udata = udata };
+    atomic_init(&j.pending, t);
+    pthread_mutex_init(&j.lock, NULL);
+    pthread_cond_init(&j.done, NULL);
+
+    // This thread takes the newest tasks first, so the slices are pushed
+    // from the last one, and run from the first one on while the later ones
+    // are stolen. They are counted before they are pushed, so that a worker
+    // that takes one right away does not count it off first. A slice that
+    // cannot be pushed runs right here instead.
+    deque* own = &p->deques[own_deque(p)];
+    atomic_fetch_add(&p->queued, t - 1);
+    for (size_t i = t - 1; i > 0; --i)
+    {
+        task s = { .job = &j, .begin = n * i / t, .end = n * (i + 1) / t };
+        if (!deque_push(own, &s))
+        {
+            atomic_fetch_sub(&p->queued, 1);
+            run_task(p, &s);
+        }
+    }
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    task s = { .job = &j, .begin = 0, .end = n / t };
+    run_task(p, &s);
+    while (atomic_load(&j.pending) > 0 && find_task(p, &s))
+        run_task(p, &s);
+
+    // The rest of the slices are running on other threads.
+    uint64_t t0 = now_ns();
+    pthread_mutex_lock(&j.lock);
+    while (atomic_load(&j.pending) > 0)
+        pthread_cond_wait(&j.done, &j.lock);
+    pthread_mutex_unlock(&j.lock);
+    blocked += now_ns() - t0;
+    pthread_cond_destroy(&j.done);
+    pthread_mutex_destroy(&j.lock);
+}
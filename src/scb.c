@@ -3,8 +3,10 @@
 // license that can be found in the LICENSE file or at
 // https://opensource.org/licenses/MIT.
 
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <math.h>
 
@@ -13,10 +15,9 @@
 #include <openssl/sha.h>
 
 #include "hashmap.h"
+#include "parallel.h"
 #include "scb.h"
-
-typedef struct hash_to_count { size_t hash; size_t count; } hash_to_count;
-typedef struct hash_to_block { size_t hash; uint8_t* block; } hash_to_block;
+#include "scb_core.h"
 
 int compare_int(const void* in0, const void* in1, void* udata)
 {
@@ -28,6 +29,18 @@ uint64_t hash_int(const void* item, uint64_t seed0, uint64_t seed1)
     return hashmap_sip((size_t*)item, sizeof(size_t), seed0, seed1);
 }
 
+struct hashmap* state_new(const state_kind kind)
+{
+    size_t elsize = kind == STATE_COUNTS ? sizeof(hash_to_count) :
+                    kind == STATE_BLOCKS ? sizeof(hash_to_block) :
+                    sizeof(hash_to_copy);
+    struct hashmap* map = hashmap_new(elsize, 0, 0, 0, hash_int, compare_int,
+                                      NULL, NULL);
+    if (map != NULL)
+        hashmap_set_tag(map, kind);
+    return map;
+}
+
 void block_encode(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx)
 {
     AES_KEY aes_key;
@@ -73,6 +86,17 @@ void block_xor(const uint8_t* in0, const uint8_t* in1, uint8_t* out)
         out[i] = in0[i] ^ in1[i];
 }
 
+void block_pad(const uint8_t* key, uint8_t* hash_, const size_t count,
+               const size_t max_count, const size_t max_hash, uint8_t* out)
+{
+    for (size_t j = 0; j < max_count; ++j)
+        hash_[15 - max_hash - j] = (count >> j * 8) & 0xFF;
+    for (size_t j = 0; j < 16 - max_count - max_hash; ++j)
+        hash_[j] = 0;
+    
+    block_xor(key, hash_, out);
+}
+
 void scb_block_encrypt(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
                        const size_t max_count, const size_t max_hash,
                        scb_state* mem)
@@ -89,25 +113,19 @@ void scb_block_encrypt(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
     }
     else
     {
-        for (size_t j = 0; j < max_count; ++j)
-            hash_[15 - max_hash - j] = ((h2c->count) >> j * 8) & 0xFF;
-        for (size_t j = 0; j < 16 - max_count - max_hash; ++j)
-            hash_[j] = 0;
-        
         uint8_t xor_[16];
-        block_xor(key, hash_, xor_);
+        block_pad(key, hash_, h2c->count, max_count, max_hash, xor_);
         block_encode(key, xor_, ctx);
         hashmap_set(*mem, &(hash_to_count){ .hash = hash,
                                             .count = h2c->count + 1 });
     }
 }
 
-void scb_block_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
-                       const size_t max_count, const size_t max_hash,
-                       scb_state* mem)
+bool block_classify(const uint8_t* key, const uint8_t* ptx,
+                    const size_t max_count, const size_t max_hash,
+                    size_t* hash)
 {
     uint8_t xor_[16];
-    block_decode(key, ctx, ptx);
     block_xor(key, ptx, xor_);
     
     bool rep = true;
@@ -120,20 +138,93 @@ void scb_block_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
         }
     }
     
-    size_t hash = bytes_to_int(xor_, max_hash);
-    hash_to_block* h2b = hashmap_get(*mem, &(hash_to_block){ .hash = hash });
+    *hash = bytes_to_int(xor_, max_hash);
+    return rep;
+}
+
+const uint8_t* state_block(struct hashmap* mem, const size_t hash,
+                           const bool copy)
+{
+    state_budget* b = copy ? (state_budget*)hashmap_udata(mem) : NULL;
+    if (b != NULL)
+        return budget_block(mem, b, hash);
+    void* item = hashmap_get(mem, &(hash_to_block){ .hash = hash });
+    if (item == NULL)
+        return NULL;
+    return copy ? ((hash_to_copy*)item)->block : ((hash_to_block*)item)->block;
+}
 
-    if (rep && h2b != NULL)
+void state_store(struct hashmap* mem, const size_t hash, uint8_t* block,
+                 const bool copy)
+{
+    state_budget* b = copy ? (state_budget*)hashmap_udata(mem) : NULL;
+    if (b != NULL)
+        budget_store(mem, b, hash, block);
+    else if (copy)
     {
-        memcpy(ptx, h2b->block, 16 * sizeof(uint8_t));
+        hash_to_copy h2c = { .hash = hash };
+        memcpy(h2c.block, block, 16 * sizeof(uint8_t));
+        hashmap_set(mem, &h2c);
     }
     else
+        hashmap_set(mem, &(hash_to_block){ .hash = hash, .block = block });
+}
+
+bool block_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                   const size_t max_count, const size_t max_hash,
+                   scb_state* mem, const bool copy)
+{
+    block_decode(key, ctx, ptx);
+    
+    size_t hash;
+    bool rep = block_classify(key, ptx, max_count, max_hash, &hash);
+    const uint8_t* block = state_block(*mem, hash, copy);
+
+    if (rep && block != NULL)
     {
-        uint8_t hash_[16];
-        block_hash(ptx, hash_);
-        
-        size_t hash = bytes_to_int(hash_, max_hash);
-        hashmap_set(*mem, &(hash_to_block){ .hash = hash, .block = ptx });
+        memcpy(ptx, block, 16 * sizeof(uint8_t));
+        return false;
+    }
+
+    // A repeat block of an evicted first occurrence is left as decoded.
+    state_budget* b = copy ? (state_budget*)hashmap_udata(*mem) : NULL;
+    if (rep && b != NULL && budget_evicted(b, hash))
+        return false;
+    
+    uint8_t hash_[16];
+    block_hash(ptx, hash_);
+    state_store(*mem, bytes_to_int(hash_, max_hash), ptx, copy);
+    return true;
+}
+
+void scb_block_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                       const size_t max_count, const size_t max_hash,
+                       scb_state* mem)
+{
+    block_decrypt(key, ctx, ptx, max_count, max_hash, mem, false);
+}
+
+void scb_encrypt_last(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem)
+{
+    size_t l = ceil(len / 16.);
+    size_t m = len % 16;
+    if (m == 0)
+    {
+        scb_block_encrypt(key, ptx + (l - 1) * 16, ctx + (l - 1) * 16,
+                          max_count, max_hash, mem);
+    }
+    else
+    {
+        // Read the partial block before it is overwritten, in case `ptx`
+        // and `ctx` are the same.
+        uint8_t block[16];
+        memcpy(block, ptx + (l - 1) * 16, m * sizeof(uint8_t));
+        memcpy(block + m, ctx + (l - 2) * 16 + m, (16 - m) * sizeof(uint8_t));
+        memcpy(ctx + (l - 1) * 16, ctx + (l - 2) * 16, m * sizeof(uint8_t));
+        scb_block_encrypt(key, block, ctx + (l - 2) * 16, max_count,
+                          max_hash, mem);
     }
 }
 
@@ -150,19 +241,27 @@ void scb_encrypt(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
         scb_block_encrypt(key, ptx + i * 16, ctx + i * 16, max_count,
                           max_hash, mem);
     
+    scb_encrypt_last(key, ptx, ctx, len, max_count, max_hash, mem);
+}
+
+void scb_decrypt_last(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem)
+{
+    size_t l = ceil(len / 16.);
     size_t m = len % 16;
     if (m == 0)
     {
-        scb_block_encrypt(key, ptx + (l - 1) * 16, ctx + (l - 1) * 16,
+        scb_block_decrypt(key, ctx + (l - 1) * 16, ptx + (l - 1) * 16,
                           max_count, max_hash, mem);
     }
     else
     {
         uint8_t block[16];
-        memcpy(ctx + (l - 1) * 16, ctx + (l - 2) * 16, m * sizeof(uint8_t));
-        memcpy(block, ptx + (l - 1) * 16, m * sizeof(uint8_t));
-        memcpy(block + m, ctx + (l - 2) * 16 + m, (16 - m) * sizeof(uint8_t));
-        scb_block_encrypt(key, block, ctx + (l - 2) * 16, max_count,
+        memcpy(block, ctx + (l - 1) * 16, m * sizeof(uint8_t));
+        memcpy(block + m, ptx + (l - 2) * 16 + m, (16 - m) * sizeof(uint8_t));
+        memcpy(ptx + (l - 1) * 16, ptx + (l - 2) * 16, m * sizeof(uint8_t));
+        scb_block_decrypt(key, block, ptx + (l - 2) * 16, max_count,
                           max_hash, mem);
     }
 }
@@ -172,27 +271,449 @@ void scb_decrypt(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
                  const size_t max_hash, scb_state* mem)
 {
     if (*mem == NULL)
-        *mem = hashmap_new(sizeof(hash_to_block), 0, 0, 0, hash_int,
-                           compare_int, NULL, NULL);
+        *mem = state_new(STATE_BLOCKS);
     
     size_t l = ceil(len / 16.);
     for (size_t i = 0; i < l - 1; ++i)
         scb_block_decrypt(key, ctx + i * 16, ptx + i * 16, max_count,
                           max_hash, mem);
     
+    scb_decrypt_last(key, ctx, ptx, len, max_count, max_hash, mem);
+}
+
+void scb_decrypt_last_copy(const uint8_t* key, const uint8_t* ctx,
+                           uint8_t* ptx, const size_t len,
+                           const size_t max_count, const size_t max_hash,
+                           scb_state* mem)
+{
+    size_t l = ceil(len / 16.);
     size_t m = len % 16;
     if (m == 0)
     {
-        scb_block_decrypt(key, ctx + (l - 1) * 16, ptx + (l - 1) * 16,
-                          max_count, max_hash, mem);
+        for (size_t i = l < 2 ? 0 : l - 2; i < l; ++i)
+            block_decrypt(key, ctx + i * 16, ptx + i * 16, max_count,
+                          max_hash, mem, true);
+        return;
+    }
+
+    uint8_t* prev = ptx + (l - 2) * 16;
+    bool set = block_decrypt(key, ctx + (l - 2) * 16, prev, max_count,
+                             max_hash, mem, true);
+    size_t prev_hash = 0;
+    if (set)
+    {
+        uint8_t hash_[16];
+        block_hash(prev, hash_);
+        prev_hash = bytes_to_int(hash_, max_hash);
     }
+
+    uint8_t block[16];
+    memcpy(block, ctx + (l - 1) * 16, m * sizeof(uint8_t));
+    memcpy(block + m, prev + m, (16 - m) * sizeof(uint8_t));
+    memcpy(ptx + (l - 1) * 16, prev, m * sizeof(uint8_t));
+
+    // scb_decrypt_last decodes the last full block over the stolen one while
+    // the state may still point there, so that a reference to the stolen
+    // block copies the decoded block onto itself. Do the same here.
+    uint8_t dec[16];
+    size_t hash;
+    block_decode(key, block, dec);
+    if (set && block_classify(key, dec, max_count, max_hash, &hash) &&
+        hash == prev_hash)
+        memcpy(prev, dec, 16 * sizeof(uint8_t));
     else
+        block_decrypt(key, block, prev, max_count, max_hash, mem, true);
+}
+
+void scb_decrypt_copy(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem)
+{
+    if (*mem == NULL)
+        *mem = state_new(STATE_COPIES);
+    
+    size_t l = ceil(len / 16.);
+    for (size_t i = 0; i + 2 < l; ++i)
+        block_decrypt(key, ctx + i * 16, ptx + i * 16, max_count, max_hash,
+                      mem, true);
+    
+    scb_decrypt_last_copy(key, ctx, ptx, len, max_count, max_hash, mem);
+}
+
+void sort_pairs_with(hash_to_index* pairs, hash_to_index* tmp, const size_t n)
+{
+    // LSD radix sort on the hash, one byte per pass. Stable, so pairs that
+    // share a hash keep their index order. Passes in which all pairs have
+    // the same digit (e.g. above max_hash bytes) are skipped.
+    size_t hist[8][256] = { { 0 } };
+    for (size_t i = 0; i < n; ++i)
+        for (size_t b = 0; b < 8; ++b)
+            ++hist[b][(pairs[i].hash >> b * 8) & 0xFF];
+
+    hash_to_index* src = pairs;
+    hash_to_index* dst = tmp;
+    for (size_t b = 0; b < 8; ++b)
     {
-        uint8_t block[16];
-        memcpy(ptx + (l - 1) * 16, ptx + (l - 2) * 16, m * sizeof(uint8_t));
-        memcpy(block, ctx + (l - 1) * 16, m * sizeof(uint8_t));
-        memcpy(block + m, ptx + (l - 2) * 16 + m, (16 - m) * sizeof(uint8_t));
-        scb_block_decrypt(key, block, ptx + (l - 2) * 16, max_count,
-                          max_hash, mem);
+        if (n == 0 || hist[b][(src[0].hash >> b * 8) & 0xFF] == n)
+            continue;
+
+        size_t pos[256];
+        size_t sum = 0;
+        for (size_t d = 0; d < 256; ++d)
+        {
+            pos[d] = sum;
+            sum += hist[b][d];
+        }
+        for (size_t i = 0; i < n; ++i)
+            dst[pos[(src[i].hash >> b * 8) & 0xFF]++] = src[i];
+
+        hash_to_index* swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != pairs)
+        memcpy(pairs, src, n * sizeof(*pairs));
+}
+
+bool sort_pairs(hash_to_index* pairs, const size_t n)
+{
+    hash_to_index* tmp = (hash_to_index*)malloc(n * sizeof(*tmp));
+    if (tmp == NULL && n > 0)
+        return false;
+    sort_pairs_with(pairs, tmp, n);
+    free(tmp);
+    return true;
+}
+
+typedef struct decrypt_job
+{
+    AES_KEY aes_key;
+    const uint8_t* key;
+    const uint8_t* ctx;
+    uint8_t* ptx;
+    size_t max_count;
+    size_t max_hash;
+    bool* rep;
+    size_t* hash;
+    const uint8_t** src;
+    hash_to_index* pairs;
+    size_t npairs;
+    struct hashmap* mem;
+    bool copy;
+    atomic_bool unresolved;
+} decrypt_job;
+
+void decrypt_classify(size_t begin, size_t end, void* udata)
+{
+    decrypt_job* job = (decrypt_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+    {
+        uint8_t* ptx = job->ptx + i * 16;
+        AES_decrypt(job->ctx + i * 16, ptx, &job->aes_key);
+        job->rep[i] = block_classify(job->key, ptx, job->max_count,
+                                     job->max_hash, &job->hash[i]);
+        if (!job->rep[i])
+        {
+            uint8_t hash_[16];
+            block_hash(ptx, hash_);
+            job->hash[i] = bytes_to_int(hash_, job->max_hash);
+        }
+    }
+}
+
+void decrypt_join(size_t begin, size_t end, void* udata)
+{
+    decrypt_job* job = (decrypt_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+    {
+        if (!job->rep[i])
+            continue;
+
+        // Find the last first occurrence before block i with the referenced
+        // hash, i.e. the one the sequential table would hold at this point.
+        size_t lo = 0;
+        size_t hi = job->npairs;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            hash_to_index* p = &job->pairs[mid];
+            if (p->hash < job->hash[i] ||
+                (p->hash == job->hash[i] && p->index < i))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        
+        job->src[i] = NULL;
+        if (lo > 0 && job->pairs[lo - 1].hash == job->hash[i])
+        {
+            job->src[i] = job->ptx + job->pairs[lo - 1].index * 16;
+        }
+        else
+        {
+            job->src[i] = job->mem == NULL ? NULL :
+                state_block(job->mem, job->hash[i], job->copy);
+            if (job->src[i] == NULL)
+                atomic_store(&job->unresolved, true);
+        }
+    }
+}
+
+void decrypt_resolve(size_t begin, size_t end, void* udata)
+{
+    decrypt_job* job = (decrypt_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+        if (job->rep[i])
+            memcpy(job->ptx + i * 16, job->src[i], 16 * sizeof(uint8_t));
+}
+
+bool decrypt_parallel(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem,
+                      const size_t threads, const bool copy)
+{
+    // A budget is updated on every lookup, so it is not shared by threads.
+    if (copy && *mem != NULL && hashmap_udata(*mem) != NULL)
+    {
+        scb_decrypt_copy(key, ctx, ptx, len, max_count, max_hash, mem);
+        return true;
+    }
+
+    // With copies, the last two blocks are left to scb_decrypt_last_copy.
+    size_t l = ceil(len / 16.);
+    size_t n = !copy ? l - 1 : l < 2 ? 0 : l - 2;
+
+    decrypt_job job = { .key = key, .ctx = ctx, .ptx = ptx,
+                        .max_count = max_count, .max_hash = max_hash,
+                        .mem = *mem, .copy = copy };
+    AES_set_decrypt_key(key, 128, &job.aes_key);
+    atomic_init(&job.unresolved, false);
+
+    // Everything is allocated before the output is touched, so that failing
+    // leaves it (and the state) as it was.
+    job.rep = (bool*)malloc(n * sizeof(*job.rep));
+    job.hash = (size_t*)malloc(n * sizeof(*job.hash));
+    job.src = (const uint8_t**)malloc(n * sizeof(*job.src));
+    job.pairs = (hash_to_index*)malloc(n * sizeof(*job.pairs));
+    hash_to_index* tmp = (hash_to_index*)malloc(n * sizeof(*tmp));
+    if (n > 0 && (job.rep == NULL || job.hash == NULL || job.src == NULL ||
+                  job.pairs == NULL || tmp == NULL))
+    {
+        free(job.rep);
+        free(job.hash);
+        free(job.src);
+        free(job.pairs);
+        free(tmp);
+        return false;
+    }
+
+    // Pass 1: decrypt and classify all blocks but the last one, hashing
+    // the first occurrences.
+    parallel_for(threads, n, decrypt_classify, &job);
+
+    for (size_t i = 0; i < n; ++i)
+        if (!job.rep[i])
+            job.pairs[job.npairs++] = (hash_to_index){ .hash = job.hash[i],
+                                                       .index = i };
+    sort_pairs_with(job.pairs, tmp, job.npairs);
+    free(tmp);
+
+    // Pass 2: join each repeat block against the sorted first occurrences
+    // (then against the given state).
+    parallel_for(threads, n, decrypt_join, &job);
+
+    if (*mem == NULL)
+        *mem = state_new(copy ? STATE_COPIES : STATE_BLOCKS);
+
+    if (!atomic_load(&job.unresolved))
+    {
+        parallel_for(threads, n, decrypt_resolve, &job);
+
+        // Only the last first occurrence of each hash survives in the
+        // sequential table.
+        for (size_t i = 0; i < job.npairs; ++i)
+            if (i + 1 == job.npairs || job.pairs[i + 1].hash != job.pairs[i].hash)
+                state_store(*mem, job.pairs[i].hash,
+                            ptx + job.pairs[i].index * 16, copy);
+    }
+    else
+    {
+        // Some repeat block has no match, so it counts as a first occurrence
+        // itself and may be referenced later: replay the table sequentially
+        // over the already decrypted blocks (no AES involved).
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (job.rep[i])
+            {
+                const uint8_t* block = state_block(*mem, job.hash[i], copy);
+                if (block != NULL)
+                {
+                    memcpy(ptx + i * 16, block, 16 * sizeof(uint8_t));
+                    continue;
+                }
+
+                uint8_t hash_[16];
+                block_hash(ptx + i * 16, hash_);
+                job.hash[i] = bytes_to_int(hash_, max_hash);
+            }
+            state_store(*mem, job.hash[i], ptx + i * 16, copy);
+        }
+    }
+
+    if (copy)
+        scb_decrypt_last_copy(key, ctx, ptx, len, max_count, max_hash, mem);
+    else
+        scb_decrypt_last(key, ctx, ptx, len, max_count, max_hash, mem);
+
+    free(job.rep);
+    free(job.hash);
+    free(job.src);
+    free(job.pairs);
+    return true;
+}
+
+bool scb_decrypt_parallel(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                          const size_t len, const size_t max_count,
+                          const size_t max_hash, scb_state* mem,
+                          const size_t threads)
+{
+    return decrypt_parallel(key, ctx, ptx, len, max_count, max_hash, mem,
+                            threads, false);
+}
+
+bool scb_decrypt_parallel_copy(const uint8_t* key, const uint8_t* ctx,
+                               uint8_t* ptx, const size_t len,
+                               const size_t max_count, const size_t max_hash,
+                               scb_state* mem, const size_t threads)
+{
+    return decrypt_parallel(key, ctx, ptx, len, max_count, max_hash, mem,
+                            threads, true);
+}
+
+typedef struct encrypt_job
+{
+    AES_KEY aes_key;
+    const uint8_t* key;
+    const uint8_t* ptx;
+    uint8_t* ctx;
+    size_t max_count;
+    size_t max_hash;
+    hash_to_index* pairs;
+    size_t npairs;
+    struct hashmap* mem;
+    bool in_place;
+} encrypt_job;
+
+void encrypt_hash(size_t begin, size_t end, void* udata)
+{
+    encrypt_job* job = (encrypt_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+    {
+        // The full hash is kept in the output block until the AES input
+        // for the block is known, unless that would overwrite the input.
+        uint8_t hash_[16];
+        uint8_t* out = job->in_place ? hash_ : job->ctx + i * 16;
+        block_hash(job->ptx + i * 16, out);
+        job->pairs[i] = (hash_to_index){
+            .hash = bytes_to_int(out, job->max_hash), .index = i };
+    }
+}
+
+void encrypt_count(size_t begin, size_t end, void* udata)
+{
+    encrypt_job* job = (encrypt_job*)udata;
+    hash_to_index* pairs = job->pairs;
+    
+    // Only handle the runs of equal hashes that start in [begin, end).
+    while (begin > 0 && begin < job->npairs &&
+           pairs[begin].hash == pairs[begin - 1].hash)
+        ++begin;
+    
+    for (size_t i = begin; i < end; )
+    {
+        size_t j = i;
+        hash_to_count* h2c = job->mem == NULL ? NULL :
+            hashmap_get(job->mem, &(hash_to_count){ .hash = pairs[i].hash });
+        if (h2c == NULL)
+        {
+            size_t k = pairs[j++].index;
+            if (!job->in_place)
+                memcpy(job->ctx + k * 16, job->ptx + k * 16,
+                       16 * sizeof(uint8_t));
+        }
+        
+        for (size_t count = h2c == NULL ? 0 : h2c->count;
+             j < job->npairs && pairs[j].hash == pairs[i].hash; ++j, ++count)
+        {
+            uint8_t* block = job->ctx + pairs[j].index * 16;
+            if (job->in_place)
+                block_hash(block, block);
+            block_pad(job->key, block, count, job->max_count, job->max_hash,
+                      block);
+        }
+        i = j;
+    }
+}
+
+void encrypt_encode(size_t begin, size_t end, void* udata)
+{
+    encrypt_job* job = (encrypt_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+        AES_encrypt(job->ctx + i * 16, job->ctx + i * 16, &job->aes_key);
+}
+
+bool scb_encrypt_sort(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                      const size_t len, const size_t max_count,
+                      const size_t max_hash, scb_state* mem,
+                      const size_t threads)
+{
+    size_t l = ceil(len / 16.);
+    size_t n = l - 1;
+
+    encrypt_job job = { .key = key, .ptx = ptx, .ctx = ctx,
+                        .max_count = max_count, .max_hash = max_hash,
+                        .npairs = n, .mem = *mem, .in_place = ptx == ctx };
+    AES_set_encrypt_key(key, 128, &job.aes_key);
+    job.pairs = (hash_to_index*)malloc(n * sizeof(*job.pairs));
+    hash_to_index* tmp = (hash_to_index*)malloc(n * sizeof(*tmp));
+    if (n > 0 && (job.pairs == NULL || tmp == NULL))
+    {
+        free(job.pairs);
+        free(tmp);
+        return false;
     }
-}
\ No newline at end of file
+
+    // Materialize the (hash, index) pairs of all blocks but the last one,
+    // then sort them by hash, keeping the index order within each hash.
+    parallel_for(threads, n, encrypt_hash, &job);
+    sort_pairs_with(job.pairs, tmp, n);
+    free(tmp);
+
+    // Assign the counts run by run, scattering the AES inputs back into
+    // the output, and encrypt them all at once.
+    parallel_for(threads, n, encrypt_count, &job);
+    parallel_for(threads, n, encrypt_encode, &job);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (i == 0 || job.pairs[i].hash != job.pairs[i - 1].hash)
+            ++distinct;
+    if (*mem == NULL)
+        *mem = hashmap_new(sizeof(hash_to_count), (distinct + 1) * 4 / 3, 0, 0,
+                           hash_int, compare_int, NULL, NULL);
+
+    for (size_t i = 0, j; i < n; i = j)
+    {
+        for (j = i + 1; j < n && job.pairs[j].hash == job.pairs[i].hash; ++j);
+        hash_to_count* h2c =
+            hashmap_get(*mem, &(hash_to_count){ .hash = job.pairs[i].hash });
+        size_t count = h2c == NULL ? j - i - 1 : h2c->count + j - i;
+        hashmap_set(*mem, &(hash_to_count){ .hash = job.pairs[i].hash,
+                                            .count = count });
+    }
+
+    scb_encrypt_last(key, ptx, ctx, len, max_count, max_hash, mem);
+
+    free(job.pairs);
+    return true;
+}
@@ -0,0 +1,378 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "compat.h"
+#include "scb.h"
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Fills `ptx` with `blocks` blocks drawn uniformly from `distinct` distinct
+// blocks (xorshift64, fixed seed).
+void fill(uint8_t* ptx, const size_t blocks, const size_t distinct)
+{
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i = 0; i < blocks; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t v = x % distinct;
+        memcpy(ptx + i * 16, &v, sizeof(v));
+        memcpy(ptx + i * 16 + 8, &v, sizeof(v));
+    }
+}
+
+double mbps(const size_t len, const double t)
+{
+    return len / t / (1 << 20);
+}
+
+// Checks that a state reset more than 255 times (which wraps its generation)
+// encrypts as a new one, and that clones, also of a state with a budget, go
+// on as the original does. `ctx` is the encryption of `ptx` from scratch.
+bool check_reset_clone(const uint8_t* key, const uint8_t* ptx,
+                       const uint8_t* ctx, const size_t len,
+                       const size_t max_count, const size_t max_hash)
+{
+    uint8_t* out0 = (uint8_t*)malloc(len);
+    uint8_t* out1 = (uint8_t*)malloc(len);
+    size_t part = len < 1024 ? len : 1024;
+    size_t half = len / 32 * 16;
+
+    scb_state mem = NULL;
+    scb_encrypt(key, ptx, out0, len, max_count, max_hash, &mem);
+    bool ok = true;
+    for (size_t i = 0; i < 300; ++i)
+    {
+        scb_state_reset(mem);
+        scb_encrypt(key, ptx, out0, part, max_count, max_hash, &mem);
+        ok &= !memcmp(out0, ctx, part);
+    }
+    scb_state_reset(mem);
+    scb_encrypt(key, ptx, out0, half, max_count, max_hash, &mem);
+    scb_state copy = NULL;
+    ok &= scb_state_clone(mem, &copy);
+    scb_encrypt(key, ptx + half, out0 + half, len - half, max_count,
+                max_hash, &mem);
+    if (copy != NULL)
+        scb_encrypt(key, ptx + half, out1 + half, len - half, max_count,
+                    max_hash, &copy);
+    ok &= !memcmp(out0, ctx, len) && !memcmp(out0 + half, out1 + half,
+                                             len - half);
+    scb_state_free(mem);
+    scb_state_free(copy);
+
+    // A budget small enough to evict, so that its lists are cloned too.
+    mem = NULL;
+    copy = NULL;
+    ok &= scb_state_new_budget(&mem, 64 << 10);
+    scb_decrypt_copy(key, ctx, out0, half, max_count, max_hash, &mem);
+    ok &= scb_state_clone(mem, &copy);
+    scb_decrypt_copy(key, ctx + half, out0 + half, len - half, max_count,
+                     max_hash, &mem);
+    if (copy != NULL)
+        scb_decrypt_copy(key, ctx + half, out1 + half, len - half, max_count,
+                         max_hash, &copy);
+    size_t stats[4];
+    scb_state_budget_stats(mem, &stats[0], &stats[1]);
+    scb_state_budget_stats(copy, &stats[2], &stats[3]);
+    ok &= !memcmp(out0 + half, out1 + half, len - half) &&
+          stats[0] == stats[2] && stats[1] == stats[3];
+    scb_state_free(mem);
+    scb_state_free(copy);
+
+    free(out0);
+    free(out1);
+    return ok;
+}
+
+// Checks that encrypting A, taking a snapshot, encrypting B and then rolling
+// back and encrypting C gives for C what encrypting A and C does, and that
+// committing instead gives what encrypting A, B and C does, with B both
+// short and long enough for the table to grow during the snapshot.
+bool check_snapshot(const uint8_t* key, const uint8_t* ptx,
+                    const uint8_t* ctx, const size_t len,
+                    const size_t max_count, const size_t max_hash)
+{
+    uint8_t* out = (uint8_t*)malloc(len);
+    uint8_t* ref = (uint8_t*)malloc(len);
+    size_t a = len / 128 * 16;
+    bool ok = true;
+    for (size_t k = 0; k < 2; ++k)
+    {
+        size_t b = k == 0 ? 256 : len / 2 / 16 * 16;
+        const uint8_t* c = ptx + a + b;
+        size_t c_len = len - a - b;
+
+        scb_state mem = NULL;
+        scb_encrypt(key, ptx, ref, a, max_count, max_hash, &mem);
+        scb_encrypt(key, c, ref + a + b, c_len, max_count, max_hash, &mem);
+        scb_state_free(mem);
+
+        for (size_t commit = 0; commit < 2; ++commit)
+        {
+            mem = NULL;
+            scb_encrypt(key, ptx, out, a, max_count, max_hash, &mem);
+            ok &= scb_state_snapshot(mem);
+            scb_encrypt(key, ptx + a, out + a, b, max_count, max_hash, &mem);
+            if (commit)
+                scb_state_commit(mem);
+            else
+                ok &= scb_state_rollback(mem);
+            scb_encrypt(key, c, out + a + b, c_len, max_count, max_hash,
+                        &mem);
+            ok &= commit ? !memcmp(out, ctx, len) :
+                  !memcmp(out + a + b, ref + a + b, c_len);
+            scb_state_free(mem);
+        }
+    }
+    free(out);
+    free(ref);
+    return ok;
+}
+
+// Encrypts `ptx` as messages of 64 blocks with one state, growing
+// incrementally or not, and returns the time the slowest call took.
+double worst_call(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                  const size_t len, const size_t max_count,
+                  const size_t max_hash, const bool incremental)
+{
+    scb_state mem = NULL;
+    double worst = 0;
+    for (size_t off = 0; off < len; off += 1024)
+    {
+        size_t n = len - off < 1024 ? len - off : 1024;
+        double t0 = now();
+        scb_encrypt(key, ptx + off, ctx + off, n, max_count, max_hash, &mem);
+        double t = now() - t0;
+        worst = t > worst ? t : worst;
+        if (off == 0)
+            scb_state_set_incremental(mem, incremental);
+    }
+    scb_state_free(mem);
+    return worst;
+}
+
+// Checks that a state growing incrementally, cloned (or saved and loaded)
+// after every message of 16 blocks, thus often while it is moving its
+// entries, goes on as the encryption of `ptx` from scratch, `ctx`.
+bool check_incremental(const uint8_t* key, const uint8_t* ptx,
+                       const uint8_t* ctx, const size_t len,
+                       const size_t max_count, const size_t max_hash)
+{
+    size_t n = len < (16 << 12) ? len : 16 << 12;
+    uint8_t* out0 = (uint8_t*)malloc(n);
+    uint8_t* out1 = (uint8_t*)malloc(n);
+    bool ok = true;
+    for (size_t save = 0; save < 2; ++save)
+    {
+        scb_state mem = NULL;
+        scb_encrypt(key, ptx, out0, 256, max_count, max_hash, &mem);
+        scb_state_set_incremental(mem, true);
+        for (size_t off = 256; off + 256 <= n; off += 256)
+        {
+            scb_state copy = NULL;
+            if (save)
+            {
+                FILE* f = tmpfile();
+                ok &= f != NULL && scb_state_save(mem, f);
+                if (f != NULL)
+                {
+                    rewind(f);
+                    ok &= scb_state_load(&copy, f);
+                    fclose(f);
+                }
+            }
+            else
+                ok &= scb_state_clone(mem, &copy);
+            scb_encrypt(key, ptx + off, out0 + off, 256, max_count, max_hash,
+                        &mem);
+            if (copy != NULL)
+                scb_encrypt(key, ptx + off, out1 + off, 256, max_count,
+                            max_hash, &copy);
+            ok &= !memcmp(out0 + off, ctx + off, 256) &&
+                  !memcmp(out1 + off, ctx + off, 256);
+            scb_state_free(copy);
+        }
+        scb_state_free(mem);
+    }
+    free(out0);
+    free(out1);
+    return ok;
+}
+
+// Checks that decrypting the first half of `ctx` (the encryption of `ptx`) in
+// four shards, each with a state of its own, and merging these states, lets
+// the second half decrypt as it does after the first half, with both kinds
+// of decryption state, and that an encryption state is not merged.
+bool check_merge(const uint8_t* key, const uint8_t* ptx, const uint8_t* ctx,
+                 const size_t len, const size_t max_count,
+                 const size_t max_hash, const size_t threads)
+{
+    uint8_t* out = (uint8_t*)malloc(len);
+    size_t half = len / 32 * 16;
+    bool ok = true;
+    for (size_t copy = 0; copy < 2; ++copy)
+    {
+        scb_state parts[4] = { NULL, NULL, NULL, NULL };
+        for (size_t i = 0; i < 4; ++i)
+        {
+            size_t from = half / 16 * i / 4 * 16;
+            size_t to = half / 16 * (i + 1) / 4 * 16;
+            if (copy)
+                scb_decrypt_copy(key, ctx + from, out + from, to - from,
+                                 max_count, max_hash, &parts[i]);
+            else
+                scb_decrypt(key, ctx + from, out + from, to - from,
+                            max_count, max_hash, &parts[i]);
+        }
+        scb_state mem = NULL;
+        ok &= scb_state_merge(&mem, parts, 4, threads);
+        if (copy)
+            scb_decrypt_copy(key, ctx + half, out + half, len - half,
+                             max_count, max_hash, &mem);
+        else
+            scb_decrypt(key, ctx + half, out + half, len - half, max_count,
+                        max_hash, &mem);
+        ok &= !memcmp(out + half, ptx + half, len - half);
+        for (size_t i = 0; i < 4; ++i)
+            scb_state_free(parts[i]);
+        scb_state_free(mem);
+    }
+
+    scb_state enc = NULL;
+    scb_encrypt(key, ptx, out, half, max_count, max_hash, &enc);
+    scb_state mem = NULL;
+    ok &= !scb_state_merge(&mem, &enc, 1, threads) && mem == NULL;
+    scb_state_free(enc);
+    free(out);
+    return ok;
+}
+
+// Outcome of one of the checks of a row, reported by name if it failed.
+typedef struct check
+{
+    const char* name;
+    bool ok;
+} check;
+
+int main(int argc, char* argv[])
+{
+    size_t max_log = 20;
+    size_t threads = 0;
+    if ((argc > 1 && sscanf(argv[1], "%zu", &max_log) != 1) ||
+        (argc > 2 && sscanf(argv[2], "%zu", &threads) != 1) || argc > 3)
+    {
+        printf("Usage: scb_bench [max_log_blocks] [threads]\n");
+        return -1;
+    }
+
+    const uint8_t key[16] = "thisisasecretkey";
+    const size_t max_count = 4;
+    const size_t max_hash = 12;
+    const char* dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+
+    bool failed = false;
+    printf("%10s %14s %14s %14s %14s %14s %7s %9s %9s %6s\n", "blocks",
+           "enc MB/s", "enc-sort MB/s", "enc-file MB/s", "dec MB/s",
+           "dec-par MB/s", "pool %", "worst ms", "w-inc ms", "same");
+    for (size_t log = 10; log <= max_log; log += 2)
+    {
+        size_t len = (size_t)16 << log;
+        uint8_t* ptx = (uint8_t*)malloc(len);
+        uint8_t* ctx0 = (uint8_t*)malloc(len);
+        uint8_t* ctx1 = (uint8_t*)malloc(len);
+        uint8_t* ctx2 = (uint8_t*)malloc(len);
+        uint8_t* dec0 = (uint8_t*)malloc(len);
+        uint8_t* dec1 = (uint8_t*)malloc(len);
+        fill(ptx, len / 16, (len / 16 + 1) / 2);
+
+        scb_state mem[5] = { NULL, NULL, NULL, NULL, NULL };
+        double t0 = now();
+        scb_encrypt(key, ptx, ctx0, len, max_count, max_hash, &mem[0]);
+        // Utilization of the thread pool by the parallel engines.
+        scb_pool_stats pool[4];
+        scb_pool_usage(&pool[0]);
+        double t1 = now();
+        bool sorted = scb_encrypt_sort(key, ptx, ctx1, len, max_count,
+                                       max_hash, &mem[1], threads);
+        double t2 = now();
+        scb_pool_usage(&pool[1]);
+        // The file-backed table, including its creation.
+        bool file = scb_state_new_file(&mem[4], dir, len / 16);
+        if (file)
+            scb_encrypt(key, ptx, ctx2, len, max_count, max_hash, &mem[4]);
+        double t3 = now();
+        scb_decrypt(key, ctx0, dec0, len, max_count, max_hash, &mem[2]);
+        scb_pool_usage(&pool[2]);
+        double t4 = now();
+        bool parallel = scb_decrypt_parallel(key, ctx0, dec1, len, max_count,
+                                             max_hash, &mem[3], threads);
+        double t5 = now();
+        scb_pool_usage(&pool[3]);
+        double busy = pool[1].busy - pool[0].busy + pool[3].busy - pool[2].busy;
+        double used = busy / (t2 - t1 + t5 - t4) / pool[0].threads;
+
+        // Slowest call of a message of 64 blocks, with the state growing at
+        // once or incrementally (reusing the output of enc-sort once
+        // checked).
+        check checks[] = {
+            { "enc-sort", sorted && !memcmp(ctx0, ctx1, len) },
+            { "worst", true },
+            { "w-inc", true },
+            { "enc-file", file && !memcmp(ctx0, ctx2, len) },
+            { "dec-par", parallel && !memcmp(dec0, dec1, len) },
+            { "reset/clone", check_reset_clone(key, ptx, ctx0, len,
+                                               max_count, max_hash) },
+            { "snapshot", check_snapshot(key, ptx, ctx0, len, max_count,
+                                         max_hash) },
+            { "incremental", check_incremental(key, ptx, ctx0, len,
+                                               max_count, max_hash) },
+            { "merge", check_merge(key, ptx, ctx0, len, max_count, max_hash,
+                                   threads) } };
+        double worst = worst_call(key, ptx, ctx1, len, max_count, max_hash,
+                                  false);
+        checks[1].ok = !memcmp(ctx0, ctx1, len);
+        double worst_inc = worst_call(key, ptx, ctx1, len, max_count,
+                                      max_hash, true);
+        checks[2].ok = !memcmp(ctx0, ctx1, len);
+
+        bool same = true;
+        for (size_t i = 0; i < sizeof(checks) / sizeof(*checks); ++i)
+            same &= checks[i].ok;
+        printf("%10zu %14.1f %14.1f %14.1f %14.1f %14.1f %7.1f %9.2f %9.2f "
+               "%6s\n", len / 16, mbps(len, t1 - t0), mbps(len, t2 - t1),
+               mbps(len, t3 - t2), mbps(len, t4 - t3), mbps(len, t5 - t4),
+               100 * used, 1e3 * worst, 1e3 * worst_inc, same ? "yes" : "NO");
+        for (size_t i = 0; i < sizeof(checks) / sizeof(*checks); ++i)
+            if (!checks[i].ok)
+                fprintf(stderr, "Check \"%s\" failed with %zu blocks.\n",
+                        checks[i].name, len / 16);
+        failed |= !same;
+
+        for (size_t i = 0; i < 5; ++i)
+            scb_state_free(mem[i]);
+        free(ptx);
+        free(ctx0);
+        free(ctx1);
+        free(ctx2);
+        free(dec0);
+        free(dec1);
+    }
+
+    return failed ? -2 : 0;
+}
@@ -0,0 +1,100 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Chunked SCB. Every chunk is encrypted as a message of its own, with a
+// fresh state and a key of its own, so that chunks can be processed in any
+// order, in parallel, and decrypted one at a time. Blocks repeated across
+// chunks are encrypted as first occurrences in each of them.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "parallel.h"
+#include "scb.h"
+#include "scb_core.h"
+
+void scb_chunk_key(const uint8_t* key, const size_t index, uint8_t* chunk_key)
+{
+    uint8_t in[16] = "SCBchunk";
+    for (size_t i = 0; i < 8; ++i)
+        in[8 + i] = (uint64_t)index >> i * 8;
+    block_encode(key, in, chunk_key);
+}
+
+size_t scb_chunk_count(const size_t len, const size_t chunk)
+{
+    // A rest of less than 16 bytes cannot be a message of its own, and goes
+    // to the last full chunk.
+    size_t n = len / chunk;
+    return n == 0 || len % chunk >= 16 ? n + 1 : n;
+}
+
+typedef struct chunk_job
+{
+    const uint8_t* key;
+    const uint8_t* in;
+    uint8_t* out;
+    size_t len;
+    size_t max_count;
+    size_t max_hash;
+    size_t chunk;
+    size_t first;
+    size_t count;
+    bool enc;
+} chunk_job;
+
+// Processes a slice of the chunks, reusing one state for all of them.
+static void chunk_run(size_t begin, size_t end, void* udata)
+{
+    const chunk_job* job = (const chunk_job*)udata;
+    scb_state mem = NULL;
+    for (size_t i = begin; i < end; ++i)
+    {
+        size_t offset = i * job->chunk;
+        size_t len = i + 1 == job->count ? job->len - offset : job->chunk;
+        uint8_t key[16];
+        scb_chunk_key(job->key, job->first + i, key);
+        if (job->enc)
+            scb_encrypt(key, job->in + offset, job->out + offset, len,
+                        job->max_count, job->max_hash, &mem);
+        else
+            scb_decrypt(key, job->in + offset, job->out + offset, len,
+                        job->max_count, job->max_hash, &mem);
+        scb_state_reset(mem);
+    }
+    scb_state_free(mem);
+}
+
+static void chunked(const uint8_t* key, const uint8_t* in, uint8_t* out,
+                    const size_t len, const size_t max_count,
+                    const size_t max_hash, const size_t chunk,
+                    const size_t first, const size_t threads, const bool enc)
+{
+    chunk_job job = { .key = key, .in = in, .out = out, .len = len,
+                      .max_count = max_count, .max_hash = max_hash,
+                      .chunk = chunk, .first = first,
+                      .count = scb_chunk_count(len, chunk), .enc = enc };
+    parallel_for(threads, job.count, chunk_run, &job);
+}
+
+void scb_encrypt_chunked(const uint8_t* key, const uint8_t* ptx, uint8_t* ctx,
+                         const size_t len, const size_t max_count,
+                         const size_t max_hash, const size_t chunk,
+                         const size_t first, const size_t threads)
+{
+    chunked(key, ptx, ctx, len, max_count, max_hash, chunk, first, threads,
+            true);
+}
+
+void scb_decrypt_chunked(const uint8_t* key, const uint8_t* ctx, uint8_t* ptx,
+                         const size_t len, const size_t max_count,
+                         const size_t max_hash, const size_t chunk,
+                         const size_t first, const size_t threads)
+{
+    chunked(key, ctx, ptx, len, max_count, max_hash, chunk, first, threads,
+            false);
+}
@@ -0,0 +1,539 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// External-memory (out-of-core) encryption. Pass 1 reads the input once and
+// spills a (hash, block) record per block into one of P partitions, by hash,
+// along with the partition of every block. Since all occurrences of a hash
+// end up in the same partition, in order, pass 2 can assign the counts one
+// partition at a time with a state holding only the hashes of that
+// partition, writing the ciphertext blocks of each partition to its own
+// range of a temporary file. Pass 3 interleaves these back into the output.
+// All partitions share one temporary file of records, in slots that each
+// partition chains as it fills them, so that three descriptors do whatever
+// the number of partitions. All I/O is sequential within a slot or range.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/aes.h>
+
+#include "compat.h"
+#include "hashmap.h"
+#include "parallel.h"
+#include "scb.h"
+#include "scb_core.h"
+
+#define EXT_ENTRY 64 // Bytes of state per distinct block (upper bound).
+#define EXT_MAX_PARTITIONS 65536 // Partitions are numbered with 16 bits.
+#define EXT_MIN_BUFFER 512
+#define EXT_END UINT64_MAX // No next slot.
+
+typedef struct record { uint8_t hash[16]; uint8_t block[16]; } record;
+
+// Head of a slot of records, followed by `len` bytes of them.
+typedef struct slot { uint64_t next; uint64_t len; } slot;
+
+typedef struct stream
+{
+    int fd;
+    uint8_t* buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    size_t off; // File offset of buf[0] (positional I/O), or of the slot.
+    bool err;
+} stream;
+
+// A stream whose buffer cannot be allocated starts failed, with errno set.
+static stream stream_open(const int fd, const size_t cap, const size_t off)
+{
+    stream s = { .fd = fd, .buf = (uint8_t*)malloc(cap), .cap = cap,
+                 .off = off };
+    s.err = s.buf == NULL;
+    if (s.err)
+        errno = ENOMEM;
+    return s;
+}
+
+static bool write_at(const int fd, const uint8_t* buf, const size_t len,
+                     const size_t off)
+{
+    for (size_t done = 0; done < len; )
+    {
+        ssize_t ret = pwrite(fd, buf + done, len - done, off + done);
+        if (ret < 0 && errno != EINTR)
+            return false;
+        if (ret > 0)
+            done += ret;
+    }
+    return true;
+}
+
+static bool stream_flush(stream* s)
+{
+    s->err |= !s->err && !write_at(s->fd, s->buf, s->len, s->off);
+    s->off += s->len;
+    s->len = 0;
+    return !s->err;
+}
+
+static void stream_write(stream* s, const void* data, const size_t len)
+{
+    if (s->len + len > s->cap)
+        stream_flush(s);
+    if (s->err)
+        return;
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+}
+
+// Reads exactly `len` bytes (unless the file ends first).
+static size_t stream_read(stream* s, void* data, const size_t len)
+{
+    size_t done = 0;
+    while (done < len && !s->err)
+    {
+        if (s->pos == s->len)
+        {
+            s->off += s->len;
+            s->pos = s->len = 0;
+            ssize_t ret = pread(s->fd, s->buf, s->cap, s->off);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                s->err = true;
+            if (ret <= 0)
+                break;
+            s->len = ret;
+        }
+        size_t n = s->len - s->pos < len - done ? s->len - s->pos : len - done;
+        memcpy((uint8_t*)data + done, s->buf + s->pos, n);
+        s->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+static void stream_close(stream* s)
+{
+    free(s->buf);
+    s->buf = NULL;
+}
+
+// A chain of slots of `cap` bytes each, starting with the slot at `off`.
+// Slots are taken from the end of the file, `*end`, and the next one is
+// taken when writing the one before, so that it can point to it.
+static stream chain_open(const int fd, const size_t cap, const size_t off)
+{
+    stream s = stream_open(fd, cap, off);
+    s.len = s.pos = sizeof(slot);
+    return s;
+}
+
+static bool chain_flush(stream* s, uint64_t* end, const bool last)
+{
+    slot head = { .next = last ? EXT_END : *end, .len = s->len - sizeof(head) };
+    if (!last)
+        *end += s->cap;
+    if (!s->err)
+        memcpy(s->buf, &head, sizeof(head));
+    s->err |= !s->err && !write_at(s->fd, s->buf, s->len, s->off);
+    s->off = head.next;
+    s->len = sizeof(head);
+    return !s->err;
+}
+
+static void chain_write(stream* s, uint64_t* end, const void* data,
+                        const size_t len)
+{
+    if (s->len + len > s->cap)
+        chain_flush(s, end, false);
+    if (s->err)
+        return;
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+}
+
+static size_t chain_read(stream* s, void* data, const size_t len)
+{
+    size_t done = 0;
+    while (done < len && !s->err)
+    {
+        if (s->pos == s->len)
+        {
+            if (s->off == EXT_END)
+                break;
+            ssize_t ret = pread(s->fd, s->buf, s->cap, s->off);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            slot head;
+            if (ret >= (ssize_t)sizeof(head))
+                memcpy(&head, s->buf, sizeof(head));
+            if (ret < (ssize_t)sizeof(head) ||
+                head.len > (size_t)ret - sizeof(head))
+            {
+                s->err = true;
+                break;
+            }
+            s->pos = sizeof(head);
+            s->len = sizeof(head) + head.len;
+            s->off = head.next;
+        }
+        size_t n = s->len - s->pos < len - done ? s->len - s->pos : len - done;
+        memcpy((uint8_t*)data + done, s->buf + s->pos, n);
+        s->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+static int temp_file(const char* dir)
+{
+    char* path = (char*)malloc(strlen(dir) + 16);
+    if (path == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(path, dir);
+    strcat(path, "/scb.XXXXXX");
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    free(path);
+    return fd;
+}
+
+static size_t round_down(const size_t x, const size_t unit)
+{
+    return x / unit * unit;
+}
+
+static size_t at_least(const size_t x, const size_t min)
+{
+    return x < min ? min : x;
+}
+
+// How the budget is spent. Half of it goes to the states of pass 2, a
+// quarter to the buffers of the partitions in passes 1 and 3 (and to those
+// pass 2 reads through), and the rest to other buffers.
+typedef struct ext_plan
+{
+    size_t partitions;
+    size_t slot;    // Bytes of a slot, and of the buffer of a partition
+    size_t workers; // Partitions processed concurrently in pass 2
+    size_t chunk;   // Bytes of input hashed at a time
+    size_t buf;     // Bytes of every other buffer
+} ext_plan;
+
+static ext_plan plan_external(const size_t len, const size_t budget,
+                              const size_t threads)
+{
+    // As many partitions as it takes for the states of all threads to fit,
+    // and as many of those as buffers of the smallest size fit (beyond
+    // which states outgrow the budget, as little as possible).
+    size_t blocks = len / 16;
+    size_t t = parallel_threads(threads);
+    size_t entries = at_least(budget / 2 / EXT_ENTRY, 1);
+    size_t max = at_least(budget / 4 / EXT_MIN_BUFFER, 1);
+    ext_plan p = { .partitions = blocks / (entries / t + 1) + 1 };
+    if (p.partitions > max)
+        p.partitions = max;
+    if (p.partitions > EXT_MAX_PARTITIONS)
+        p.partitions = EXT_MAX_PARTITIONS;
+
+    p.slot = sizeof(slot) + round_down(at_least(budget / 4 / p.partitions,
+                                                EXT_MIN_BUFFER),
+                                       sizeof(record));
+    p.workers = entries / (blocks / p.partitions + 1);
+    p.workers = p.workers < 1 ? 1 : p.workers > t ? t : p.workers;
+    p.chunk = round_down(at_least(budget / 16, EXT_MIN_BUFFER), 16);
+    p.buf = round_down(at_least(budget / 16 / p.workers, EXT_MIN_BUFFER), 16);
+    return p;
+}
+
+size_t scb_external_partitions(const size_t len, const size_t budget,
+                               const size_t threads)
+{
+    return plan_external(len, budget, threads).partitions;
+}
+
+typedef struct ext_job
+{
+    AES_KEY aes_key;
+    const uint8_t* key;
+    size_t max_count;
+    size_t max_hash;
+    ext_plan plan;
+    int rec_fd;
+    int ctx_fd;
+    uint64_t* first;  // First slot of each partition.
+    size_t* sizes;    // Records per partition.
+    size_t* offsets;  // Of the ciphertext of each partition, in blocks.
+    record* recs;
+    const uint8_t* chunk;
+    atomic_int error; // errno of the first failure in pass 2
+} ext_job;
+
+static void ext_fail(ext_job* job, const int error)
+{
+    int none = 0;
+    atomic_compare_exchange_strong(&job->error, &none, error);
+}
+
+static size_t partition_of(const ext_job* job, const uint8_t* hash)
+{
+    return bytes_to_int(hash, job->max_hash) % job->plan.partitions;
+}
+
+static void ext_hash(size_t begin, size_t end, void* udata)
+{
+    ext_job* job = (ext_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+    {
+        block_hash(job->chunk + i * 16, job->recs[i].hash);
+        memcpy(job->recs[i].block, job->chunk + i * 16, 16 * sizeof(uint8_t));
+    }
+}
+
+static void ext_count(size_t begin, size_t end, void* udata)
+{
+    ext_job* job = (ext_job*)udata;
+    for (size_t p = begin; p < end; ++p)
+    {
+        stream in = chain_open(job->rec_fd, job->plan.slot, job->first[p]);
+        stream out = stream_open(job->ctx_fd, job->plan.buf,
+                                 job->offsets[p] * 16);
+        struct hashmap* mem =
+            hashmap_new(sizeof(hash_to_count), job->sizes[p] / 8, 0, 0,
+                        hash_int, compare_int, NULL, NULL);
+        bool oom = mem == NULL;
+
+        record rec;
+        while (!oom && chain_read(&in, &rec, sizeof(rec)) == sizeof(rec))
+        {
+            uint8_t ctx[16];
+            size_t hash = bytes_to_int(rec.hash, job->max_hash);
+            hash_to_count* h2c =
+                hashmap_get(mem, &(hash_to_count){ .hash = hash });
+            if (h2c == NULL)
+            {
+                AES_encrypt(rec.block, ctx, &job->aes_key);
+                hashmap_set(mem, &(hash_to_count){ .hash = hash, .count = 0 });
+            }
+            else
+            {
+                block_pad(job->key, rec.hash, h2c->count, job->max_count,
+                          job->max_hash, rec.hash);
+                AES_encrypt(rec.hash, ctx, &job->aes_key);
+                hashmap_set(mem, &(hash_to_count){ .hash = hash,
+                                                   .count = h2c->count + 1 });
+            }
+            oom = hashmap_oom(mem);
+            stream_write(&out, ctx, sizeof(ctx));
+        }
+
+        if (oom)
+            ext_fail(job, ENOMEM);
+        else if (!stream_flush(&out) || in.err)
+            ext_fail(job, errno != 0 ? errno : EIO);
+        if (mem != NULL)
+            hashmap_free(mem);
+        stream_close(&in);
+        stream_close(&out);
+    }
+}
+
+int scb_encrypt_external(const uint8_t* key, const int ptx_fd,
+                         const int ctx_fd, const size_t len,
+                         const size_t max_count, const size_t max_hash,
+                         const size_t budget, const size_t threads,
+                         const char* tmp_dir)
+{
+    if (len < 16)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t n = len / 16;
+    size_t m = len % 16;
+    ext_job job = { .key = key, .max_count = max_count, .max_hash = max_hash,
+                    .plan = plan_external(len, budget, threads) };
+    size_t partitions = job.plan.partitions;
+    size_t chunk = job.plan.chunk;
+    AES_set_encrypt_key(key, 128, &job.aes_key);
+    atomic_init(&job.error, 0);
+    job.first = (uint64_t*)malloc(partitions * sizeof(*job.first));
+    job.sizes = (size_t*)calloc(partitions, sizeof(*job.sizes));
+    job.offsets = (size_t*)malloc(partitions * sizeof(*job.offsets));
+    stream* recs = (stream*)malloc(partitions * sizeof(*recs));
+    uint8_t* block = (uint8_t*)malloc(chunk);
+    job.recs = (record*)malloc(chunk / 16 * sizeof(*job.recs));
+    job.chunk = block;
+    if (job.first == NULL || job.sizes == NULL || job.offsets == NULL ||
+        recs == NULL || block == NULL || job.recs == NULL)
+    {
+        free(job.first);
+        free(job.sizes);
+        free(job.offsets);
+        free(recs);
+        free(block);
+        free(job.recs);
+        errno = ENOMEM;
+        return -1;
+    }
+    job.rec_fd = temp_file(tmp_dir);
+    job.ctx_fd = temp_file(tmp_dir);
+    int ids_fd = temp_file(tmp_dir);
+    bool err = job.rec_fd < 0 || job.ctx_fd < 0 || ids_fd < 0;
+
+    // Pass 1: hash all full blocks and spill them to their partitions.
+    uint64_t end = 0;
+    for (size_t p = 0; p < partitions; ++p)
+    {
+        job.first[p] = end;
+        end += job.plan.slot;
+        recs[p] = chain_open(job.rec_fd, job.plan.slot, job.first[p]);
+        err |= recs[p].err;
+    }
+    stream ids = stream_open(ids_fd, job.plan.buf, 0);
+    stream in = stream_open(ptx_fd, chunk, 0);
+    err |= ids.err || in.err;
+    for (size_t i = 0; i < n && !err; )
+    {
+        size_t k = n - i < chunk / 16 ? n - i : chunk / 16;
+        if (stream_read(&in, block, k * 16) != k * 16)
+        {
+            err = true;
+            break;
+        }
+        parallel_for(threads, k, ext_hash, &job);
+        for (size_t j = 0; j < k; ++j)
+        {
+            uint16_t p = partition_of(&job, job.recs[j].hash);
+            chain_write(&recs[p], &end, &job.recs[j], sizeof(record));
+            stream_write(&ids, &p, sizeof(p));
+            ++job.sizes[p];
+        }
+        i += k;
+    }
+    uint8_t tail[16];
+    if (!err && stream_read(&in, tail, m) != m)
+        err = true;
+    for (size_t p = 0; p < partitions; ++p)
+    {
+        err |= !err && !chain_flush(&recs[p], &end, true);
+        stream_close(&recs[p]);
+    }
+    err |= !err && !stream_flush(&ids);
+    stream_close(&ids);
+    stream_close(&in);
+    free(job.recs);
+    free(recs);
+
+    // Pass 2: assign the counts and encrypt, partition by partition, each
+    // into its range of the ciphertext file.
+    for (size_t p = 0, at = 0; p < partitions; ++p)
+    {
+        job.offsets[p] = at;
+        at += job.sizes[p];
+    }
+    if (!err)
+    {
+        parallel_for(job.plan.workers, partitions, ext_count, &job);
+        int error = atomic_load(&job.error);
+        err = error != 0;
+        if (err)
+            errno = error;
+    }
+
+    // Pass 3: gather the ciphertext blocks back in order.
+    uint8_t last[16];
+    if (!err)
+    {
+        size_t buf = round_down(job.plan.slot, 16);
+        stream* ctxs = (stream*)calloc(partitions, sizeof(*ctxs));
+        err = ctxs == NULL;
+        if (err)
+            errno = ENOMEM;
+        for (size_t p = 0; !err && p < partitions; ++p)
+        {
+            ctxs[p] = stream_open(job.ctx_fd, buf, job.offsets[p] * 16);
+            err = ctxs[p].err;
+        }
+        ids = stream_open(ids_fd, job.plan.buf, 0);
+        stream out = stream_open(ctx_fd, chunk, 0);
+        err |= ids.err || out.err;
+        for (size_t i = 0; i < n && !err; ++i)
+        {
+            uint16_t p;
+            if (stream_read(&ids, &p, sizeof(p)) != sizeof(p) ||
+                stream_read(&ctxs[p], last, 16) != 16)
+                err = true;
+            stream_write(&out, last, 16);
+        }
+        err |= !stream_flush(&out);
+        for (size_t p = 0; ctxs != NULL && p < partitions; ++p)
+            stream_close(&ctxs[p]);
+        stream_close(&ids);
+        stream_close(&out);
+        free(ctxs);
+    }
+
+    // Ciphertext stealing: the last partial block takes the place of block
+    // l - 2, with the count its hash has in its partition after pass 2.
+    if (!err && m != 0)
+    {
+        uint8_t hash_[16];
+        memcpy(block, tail, m * sizeof(uint8_t));
+        memcpy(block + m, last + m, (16 - m) * sizeof(uint8_t));
+        block_hash(block, hash_);
+        size_t hash = bytes_to_int(hash_, max_hash);
+
+        size_t count = 0;
+        record rec;
+        in = chain_open(job.rec_fd, job.plan.slot,
+                        job.first[partition_of(&job, hash_)]);
+        while (chain_read(&in, &rec, sizeof(rec)) == sizeof(rec))
+            count += bytes_to_int(rec.hash, max_hash) == hash;
+        err = in.err;
+        stream_close(&in);
+
+        uint8_t ctx[16];
+        if (count == 0)
+        {
+            AES_encrypt(block, ctx, &job.aes_key);
+        }
+        else
+        {
+            block_pad(key, hash_, count - 1, max_count, max_hash, hash_);
+            AES_encrypt(hash_, ctx, &job.aes_key);
+        }
+
+        err |= pwrite(ctx_fd, ctx, 16, (n - 1) * 16) != 16;
+        err |= pwrite(ctx_fd, last, m, n * 16) != (ssize_t)m;
+    }
+
+    if (job.rec_fd >= 0)
+        close(job.rec_fd);
+    if (job.ctx_fd >= 0)
+        close(job.ctx_fd);
+    if (ids_fd >= 0)
+        close(ids_fd);
+    free(block);
+    free(job.first);
+    free(job.sizes);
+    free(job.offsets);
+
+    if (err && errno == 0)
+        errno = EIO;
+    return err ? -1 : 0;
+}
@@ -8,12 +8,815 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
 
+#include <openssl/sha.h>
+
+#include "compat.h"
+#include "parallel.h"
 #include "scb.h"
 #include "util.h"
 
+typedef enum engine
+{
+    ENGINE_HASH, ENGINE_SORT, ENGINE_EXT, ENGINE_PIPE
+} engine;
+
+typedef struct file_opts
+{
+    bool verbose;
+    engine engine;
+    size_t threads; // 0 for one per processor
+    size_t budget;  // Memory budget of ENGINE_EXT, in bytes
+    size_t dec_budget; // Memory budget of the state of dec, 0 for none
+    size_t chunk;   // Bytes read at a time, a multiple of 16
+    bool mmap;      // Map input and output instead of streaming
+    bool in_place;  // Map the input and overwrite it with the output
+    bool shared;    // One state for all the files of a directory
+    bool index;     // Also write the index needed by dec-range
+    bool header;    // Start encrypted files with a header
+    size_t checkpoint; // Bytes between checkpoints of enc, 0 for none
+    size_t offset;  // Range decrypted by dec-range
+    size_t length;  // SIZE_MAX for up to the end
+    const char* table; // Directory of a file-backed state table, or NULL
+    size_t samples; // Blocks sampled by plan
+    size_t chunked; // Bytes per chunk of chunked SCB, 0 for one stream
+} file_opts;
+
+// Reads up to `len` bytes, returning fewer only at the end of the file, or
+// -1 on error.
+ssize_t read_full(int fd, uint8_t* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+bool write_full(int fd, const uint8_t* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Writes buffers from a separate thread, so that the next chunk can be
+// processed while the previous one goes to disk.
+typedef struct writer
+{
+    int fd;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const uint8_t* data;
+    size_t len;
+    bool busy;   // `data` is submitted and not yet written
+    bool closed;
+    bool failed;
+} writer;
+
+void* writer_run(void* arg)
+{
+    writer* w = (writer*)arg;
+    pthread_mutex_lock(&w->lock);
+    while (true)
+    {
+        while (!w->busy && !w->closed)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->busy)
+            break;
+        pthread_mutex_unlock(&w->lock);
+        bool ok = write_full(w->fd, w->data, w->len);
+        pthread_mutex_lock(&w->lock);
+        w->failed |= !ok;
+        w->busy = false;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+void writer_open(writer* w, int fd)
+{
+    *w = (writer){ .fd = fd };
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_create(&w->tid, NULL, writer_run, w);
+}
+
+// Waits for the previous buffer to be written, then hands over `data`, which
+// must stay untouched until the next call.
+void writer_submit(writer* w, const uint8_t* data, size_t len)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->busy)
+        pthread_cond_wait(&w->cond, &w->lock);
+    w->data = data;
+    w->len = len;
+    w->busy = len > 0;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Flushes and stops the writer, returning whether every write succeeded.
+bool writer_close(writer* w)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->busy)
+        pthread_cond_wait(&w->cond, &w->lock);
+    w->closed = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->tid, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    return !w->failed;
+}
+
+int read_key(const char* key_path, uint8_t* key)
+{
+    int key_fd = open(key_path, O_RDONLY);
+    if (key_fd < 0)
+    {
+        printf("File \"%s\" not found.\n", key_path);
+        return -3;
+    }
+    ssize_t n = read_full(key_fd, key, 16);
+    close(key_fd);
+    if (n < 16)
+    {
+        printf("File \"%s\" must contain at least 16 bytes.\n", key_path);
+        return -4;
+    }
+    return 0;
+}
+
+// Where output to "-" goes. Once standard output is used for data, it is
+// moved here and messages go to standard error instead.
+int stdout_fd = STDOUT_FILENO;
+
+char* encrypted_path(const char* ptx_path, size_t max_count, size_t max_hash)
+{
+    if (!strcmp(ptx_path, "-"))
+        return strdup("-");
+
+    char* ctx_path = (char*)malloc((strlen(ptx_path) + 11) * sizeof(*ptx_path));
+    char max_count_str[3];
+    char max_hash_str[3];
+    sprintf(max_count_str, "%zu", max_count);
+    sprintf(max_hash_str, "%zu", max_hash);
+    strcpy(ctx_path, ptx_path);
+    strcat(ctx_path, ".enc_");
+    strcat(ctx_path, max_count_str);
+    strcat(ctx_path, "_");
+    strcat(ctx_path, max_hash_str);
+
+    return ctx_path;
+}
+
+// Optional header of an encrypted file, which makes it self-describing:
+//  0  magic "\x89SCB\r\n\x1a\n"
+//  8  version, max_count, max_hash, hash function (1 for SHA-256, 2 for
+//     MD4, as chosen by USE_SHA)
+// 12  blocks per chunk of chunked SCB (32-bit little-endian, version 2
+//     only, else zero)
+// 16  length of the plaintext (64-bit little-endian)
+// 24  key check value (SHA-256 of the key and the magic, 4 bytes)
+// 28  checksum (SHA-256 of the bytes before, 4 bytes)
+#define HEADER_LEN 32
+#define HEADER_VERSION 1
+#define HEADER_VERSION_CHUNKED 2
+#define HEADER_MAGIC "\x89SCB\r\n\x1a\n"
+#ifdef USE_SHA
+#define HEADER_HASH 1
+#else
+#define HEADER_HASH 2
+#endif
+
+void header_write(uint8_t* h, const uint8_t* key, size_t max_count,
+                  size_t max_hash, size_t len, size_t chunked)
+{
+    memset(h, 0, HEADER_LEN * sizeof(uint8_t));
+    memcpy(h, HEADER_MAGIC, 8 * sizeof(uint8_t));
+    h[8] = chunked != 0 ? HEADER_VERSION_CHUNKED : HEADER_VERSION;
+    h[9] = max_count;
+    h[10] = max_hash;
+    h[11] = HEADER_HASH;
+    for (size_t i = 0; i < 4; ++i)
+        h[12 + i] = (uint32_t)(chunked / 16) >> i * 8;
+    for (size_t i = 0; i < 8; ++i)
+        h[16 + i] = (uint64_t)len >> i * 8;
+
+    uint8_t check[24];
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    memcpy(check, key, 16 * sizeof(uint8_t));
+    memcpy(check + 16, HEADER_MAGIC, 8 * sizeof(uint8_t));
+    SHA256(check, 24, hash);
+    memcpy(h + 24, hash, 4 * sizeof(uint8_t));
+    SHA256(h, 28, hash);
+    memcpy(h + 28, hash, 4 * sizeof(uint8_t));
+}
+
+bool header_present(const uint8_t* h, size_t len)
+{
+    return len >= HEADER_LEN && !memcmp(h, HEADER_MAGIC, 8);
+}
+
+// Checks the header `h` of the file `path` against the key and the given
+// parameters, where 0 stands for any value and is replaced by the one in
+// the header (also for the chunk size, 0 in the header for one stream).
+// Prints the error and returns its code on mismatch.
+int header_check(const uint8_t* h, const char* path, const uint8_t* key,
+                 size_t* max_count, size_t* max_hash, size_t* len,
+                 size_t* chunked)
+{
+    uint8_t expected[HEADER_LEN];
+    uint64_t n = 0;
+    for (size_t i = 0; i < 8; ++i)
+        n |= (uint64_t)h[16 + i] << i * 8;
+    size_t chunk = 0;
+    for (size_t i = 0; i < 4; ++i)
+        chunk |= (size_t)h[12 + i] << i * 8;
+    chunk *= 16;
+    header_write(expected, key, h[9], h[10], n, chunk);
+    uint8_t sum[SHA256_DIGEST_LENGTH];
+    SHA256(h, 28, sum);
+    if (memcmp(h + 28, sum, 4))
+    {
+        printf("File \"%s\" has a corrupted header.\n", path);
+        return -5;
+    }
+    if (memcmp(h + 24, expected + 24, 4))
+    {
+        printf("File \"%s\" was encrypted with a different key.\n", path);
+        return -5;
+    }
+    if ((h[8] != HEADER_VERSION && h[8] != HEADER_VERSION_CHUNKED) ||
+        (h[8] == HEADER_VERSION_CHUNKED) != (chunk != 0))
+    {
+        printf("File \"%s\" has an unsupported header version.\n", path);
+        return -5;
+    }
+    if (h[11] != HEADER_HASH)
+    {
+        printf("File \"%s\" was encrypted with another hash function " \
+               "(%s).\n", path, h[11] == 1 ? "SHA-256" :
+                                h[11] == 2 ? "MD4" : "unknown");
+        return -2;
+    }
+    if ((*max_count != 0 && *max_count != h[9]) ||
+        (*max_hash != 0 && *max_hash != h[10]))
+    {
+        printf("File \"%s\" was encrypted with max_count %d and max_hash " \
+               "%d.\n", path, h[9], h[10]);
+        return -2;
+    }
+    if (*chunked != 0 && *chunked != chunk)
+    {
+        printf(chunk != 0 ? "File \"%s\" was encrypted with chunked=%zu.\n" :
+                            "File \"%s\" was not encrypted with chunked.\n",
+               path, chunk);
+        return -2;
+    }
+    *max_count = h[9];
+    *max_hash = h[10];
+    *len = n;
+    *chunked = chunk;
+    return 0;
+}
+
+// Reads the header of the encrypted file on `fd` and checks it as
+// header_check does, also against the file size if known. Without header,
+// `*len` is SIZE_MAX and the bytes read are left in `head` (`*head_len` of
+// them) for decryption.
+int header_read(int fd, const char* path, const uint8_t* key,
+                size_t* max_count, size_t* max_hash, size_t* len,
+                size_t* chunked, uint8_t* head, size_t* head_len)
+{
+    ssize_t n = read_full(fd, head, HEADER_LEN);
+    if (n < 0)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        return -6;
+    }
+    *len = SIZE_MAX;
+    *head_len = n;
+    if (!header_present(head, n))
+    {
+        if (*max_count != 0 && *max_hash != 0)
+            return 0;
+        printf("File \"%s\" has no header, so max_count and max_hash " \
+               "must be given.\n", path);
+        return -2;
+    }
+
+    int ret = header_check(head, path, key, max_count, max_hash, len,
+                           chunked);
+    if (ret != 0)
+        return ret;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (size_t)st.st_size != *len + HEADER_LEN)
+    {
+        printf("File \"%s\" should contain %zu bytes after the header.\n",
+               path, *len);
+        return -5;
+    }
+    *head_len = 0;
+    return 0;
+}
+
+int encrypt_file_external(const uint8_t* key, size_t max_count,
+                          size_t max_hash, char* ptx_path,
+                          const file_opts* opts)
+{
+    int ptx_fd = open(ptx_path, O_RDONLY);
+    if (ptx_fd < 0)
+    {
+        printf("File \"%s\" not found.\n", ptx_path);
+        return -5;
+    }
+    struct stat st;
+    fstat(ptx_fd, &st);
+    size_t len = st.st_size;
+
+    // The temporary files go next to the output, which must have room for
+    // about as much data anyway (unlike TMPDIR, which may live in memory).
+    char* ctx_path = encrypted_path(ptx_path, max_count, max_hash);
+    char* tmp_path = strdup(ctx_path);
+    char* tmp_dir = dirname(tmp_path);
+    int ctx_fd = open(ctx_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ctx_fd < 0)
+    {
+        printf("File \"%s\" cannot be written.\n", ctx_path);
+        close(ptx_fd);
+        free(ctx_path);
+        free(tmp_path);
+        return -6;
+    }
+
+    if (opts->verbose)
+        printf("SCB encrypting out-of-core (%zu partitions) ... ",
+               scb_external_partitions(len, opts->budget, opts->threads));
+    fflush(stdout);
+    int ret = scb_encrypt_external(key, ptx_fd, ctx_fd, len, max_count,
+                                   max_hash, opts->budget, opts->threads,
+                                   tmp_dir);
+    if (ret != 0)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        unlink(ctx_path);
+    }
+    else if (opts->verbose)
+        printf(len <= ((size_t)1 << max_count * 8) ?
+               "Done (SECURE: %zu <= %zu).\n" :
+               "Done (INSECURE: %zu > %zu).\n",
+               len, (size_t)1 << max_count * 8);
+
+    close(ptx_fd);
+    close(ctx_fd);
+    free(ctx_path);
+    free(tmp_path);
+
+    return ret == 0 ? 0 : -6;
+}
+
+// Open the input or output of a streamed file operation, printing the
+// error and returning its code on failure. The path "-" stands for standard
+// input or output.
+int open_input(const char* in_path, int* in_fd)
+{
+    *in_fd = strcmp(in_path, "-") ? open(in_path, O_RDONLY) : STDIN_FILENO;
+    if (*in_fd == STDIN_FILENO)
+        binary_mode(STDIN_FILENO);
+    if (*in_fd < 0)
+    {
+        printf("File \"%s\" not found.\n", in_path);
+        return -5;
+    }
+    return 0;
+}
+
+int open_output(const char* out_path, int* out_fd)
+{
+    *out_fd = strcmp(out_path, "-") ?
+              open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : stdout_fd;
+    if (*out_fd < 0)
+    {
+        printf("File \"%s\" cannot be written.\n", out_path);
+        return -6;
+    }
+    return 0;
+}
+
+int open_files(const char* in_path, int* in_fd, const char* out_path,
+               int* out_fd)
+{
+    int ret = open_input(in_path, in_fd);
+    if (ret != 0)
+        return ret;
+    ret = open_output(out_path, out_fd);
+    if (ret != 0)
+        close(*in_fd);
+    return ret;
+}
+
+// Closes the files of a streamed file operation of `len` bytes, reporting
+// read or write errors and inputs too short for SCB (whose output is then
+// removed).
+int close_files(const char* in_path, int in_fd, const char* out_path,
+                int out_fd, size_t len, bool ok)
+{
+    close(in_fd);
+    close(out_fd);
+    if (!ok)
+        printf("Failed (%s).\n", strerror(errno));
+    else if (len < 16)
+        printf("File \"%s\" must contain at least 16 bytes.\n", in_path);
+    if (ok && len >= 16)
+        return 0;
+    if (strcmp(out_path, "-"))
+        unlink(out_path);
+    return ok ? -5 : -6;
+}
+
+// Maps the input of an operation read-only and its output, pre-sized to
+// the same `len` bytes, for writing. The first `in_skip` bytes of the input
+// and `out_skip` bytes of the output (for a header) are left out of `len`
+// and the returned pointers. Prints the error and returns its code on
+// failure.
+int map_files(const char* in_path, const uint8_t** in, const char* out_path,
+              uint8_t** out, size_t* len, size_t in_skip, size_t out_skip)
+{
+    int in_fd = open(in_path, O_RDONLY);
+    if (in_fd < 0)
+    {
+        printf("File \"%s\" not found.\n", in_path);
+        return -5;
+    }
+    struct stat st;
+    fstat(in_fd, &st);
+    *len = st.st_size - in_skip;
+    if ((size_t)st.st_size < in_skip + 16)
+    {
+        printf("File \"%s\" must contain at least 16 bytes.\n", in_path);
+        close(in_fd);
+        return -5;
+    }
+    int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+    {
+        printf("File \"%s\" cannot be written.\n", out_path);
+        close(in_fd);
+        return -6;
+    }
+
+    // Reserving the blocks up front makes a full disk fail here rather than
+    // with SIGBUS while writing to the mapping.
+    uint8_t* in_map = MAP_FAILED;
+    uint8_t* out_map = MAP_FAILED;
+    if (ftruncate(out_fd, *len + out_skip) == 0 &&
+        (errno = posix_fallocate(out_fd, 0, *len + out_skip)) == 0)
+    {
+        in_map = (uint8_t*)mmap(NULL, *len + in_skip, PROT_READ,
+                                MAP_PRIVATE, in_fd, 0);
+        out_map = (uint8_t*)mmap(NULL, *len + out_skip,
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, out_fd,
+                                 0);
+    }
+    close(in_fd);
+    close(out_fd);
+    if (in_map == MAP_FAILED || out_map == MAP_FAILED)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        if (in_map != MAP_FAILED)
+            munmap(in_map, *len + in_skip);
+        if (out_map != MAP_FAILED)
+            munmap(out_map, *len + out_skip);
+        unlink(out_path);
+        return -6;
+    }
+    madvise(in_map, *len + in_skip, MADV_SEQUENTIAL);
+    *in = in_map + in_skip;
+    *out = out_map + out_skip;
+    return 0;
+}
+
+// Maps a file for reading, and with `write` also for writing, to encrypt or
+// decrypt it in place. Prints the error and returns its code on failure.
+int map_file(const char* path, uint8_t** buf, size_t* len, bool write)
+{
+    int fd = open(path, write ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        printf("File \"%s\" not found.\n", path);
+        return -5;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    *len = st.st_size;
+    if (*len < 16)
+    {
+        printf("File \"%s\" must contain at least 16 bytes.\n", path);
+        close(fd);
+        return -5;
+    }
+    *buf = (uint8_t*)mmap(NULL, *len, write ? PROT_READ | PROT_WRITE :
+                          PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (*buf == MAP_FAILED)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        return -6;
+    }
+    // Read-only maps serve dec-range, which jumps to first occurrences.
+    madvise(*buf, *len, write ? MADV_SEQUENTIAL : MADV_RANDOM);
+    return 0;
+}
+
+// Unmaps the files of a mapped operation, and in place, moves the input to
+// the output path.
+int unmap_files(const char* in_path, const uint8_t* in, const char* out_path,
+                uint8_t* out, size_t len, size_t in_skip, size_t out_skip,
+                const file_opts* opts)
+{
+    munmap(out - out_skip, len + out_skip);
+    if (!opts->in_place)
+    {
+        munmap((void*)(in - in_skip), len + in_skip);
+        return 0;
+    }
+    if (rename(in_path, out_path) != 0)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        return -6;
+    }
+    return 0;
+}
+
+// Unmaps the files of a mapped operation that failed without touching the
+// input, and removes the output (unless in place).
+void unmap_failed(const uint8_t* in, const char* out_path, uint8_t* out,
+                  size_t len, size_t in_skip, size_t out_skip,
+                  const file_opts* opts)
+{
+    munmap(out - out_skip, len + out_skip);
+    if (!opts->in_place)
+    {
+        munmap((void*)(in - in_skip), len + in_skip);
+        unlink(out_path);
+    }
+}
+
+// Header of the index file written next to the ciphertext, followed by the
+// `n` pairs of the index.
+typedef struct index_header
+{
+    char magic[8]; // "SCBIDX1"
+    size_t max_count;
+    size_t max_hash;
+    size_t len;    // Length of the ciphertext
+    size_t n;
+} index_header;
+
+char* index_path(const char* ctx_path)
+{
+    char* idx_path = (char*)malloc((strlen(ctx_path) + 5) * sizeof(*ctx_path));
+    strcpy(idx_path, ctx_path);
+    strcat(idx_path, ".idx");
+    return idx_path;
+}
+
+// Sorts the index of the encryption of a file of `len` bytes into
+// `ctx_path` and writes it to the index file, printing the error and
+// returning its code on failure (also if building it failed, unless
+// `indexed`).
+int write_index(const char* ctx_path, scb_index* idx, bool indexed,
+                size_t max_count, size_t max_hash, size_t len)
+{
+    if (!indexed || !scb_index_final(idx))
+    {
+        printf("Failed (%s).\n", strerror(ENOMEM));
+        return -6;
+    }
+    index_header h = { .magic = "SCBIDX1", .max_count = max_count,
+                       .max_hash = max_hash, .len = len, .n = idx->n };
+    char* idx_path = index_path(ctx_path);
+    int fd = open(idx_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write_full(fd, (const uint8_t*)&h, sizeof(h)) &&
+              write_full(fd, (const uint8_t*)idx->entries,
+                         idx->n * 2 * sizeof(size_t));
+    if (!ok)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        unlink(idx_path);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(idx_path);
+    return ok ? 0 : -6;
+}
+
+// Creates the encryption state for the plaintext `ptx_path` in a file if
+// asked to, sized for its blocks being all distinct, or leaves it to be
+// created in memory.
+int new_state(scb_state* mem, const char* ptx_path, const file_opts* opts)
+{
+    struct stat st;
+    size_t len = stat(ptx_path, &st) == 0 ? (size_t)st.st_size : 0;
+    if (opts->table != NULL && !scb_state_new_file(mem, opts->table, len / 16))
+    {
+        printf("Cannot create state table in \"%s\".\n", opts->table);
+        return -5;
+    }
+    return 0;
+}
+
+int encrypt_file_mapped(const uint8_t* key, size_t max_count, size_t max_hash,
+                        char* ptx_path, const file_opts* opts)
+{
+    scb_state mem = NULL;
+    int ret = new_state(&mem, ptx_path, opts);
+    if (ret != 0)
+        return ret;
+
+    char* ctx_path = encrypted_path(ptx_path, max_count, max_hash);
+    const uint8_t* ptx;
+    uint8_t* ctx;
+    size_t len;
+    size_t head = opts->header ? HEADER_LEN : 0;
+    ret = opts->in_place ? map_file(ptx_path, &ctx, &len, true) :
+              map_files(ptx_path, &ptx, ctx_path, &ctx, &len, 0, head);
+    if (ret != 0)
+    {
+        scb_state_free(mem);
+        free(ctx_path);
+        return ret;
+    }
+    if (opts->in_place)
+        ptx = ctx;
+    if (opts->header)
+        header_write(ctx - head, key, max_count, max_hash, len, opts->chunked);
+
+    if (opts->verbose)
+        printf("SCB encrypting ... ");
+    fflush(stdout);
+    bool ok = true;
+    if (opts->chunked != 0)
+        scb_encrypt_chunked(key, ptx, ctx, len, max_count, max_hash,
+                            opts->chunked, 0, opts->threads);
+    else if (opts->engine == ENGINE_SORT)
+        ok = scb_encrypt_sort(key, ptx, ctx, len, max_count, max_hash, &mem,
+                              opts->threads);
+    else
+        scb_encrypt(key, ptx, ctx, len, max_count, max_hash, &mem);
+    if (!ok)
+    {
+        printf("Failed (%s).\n", strerror(ENOMEM));
+        scb_state_free(mem);
+        unmap_failed(ptx, ctx_path, ctx, len, 0, head, opts);
+        free(ctx_path);
+        return -6;
+    }
+    if (opts->index)
+    {
+        scb_index idx;
+        scb_index_init(&idx);
+        bool indexed = scb_index_update(&idx, key, ptx, ctx, len, max_hash,
+                                        true);
+        ret = write_index(ctx_path, &idx, indexed, max_count, max_hash, len);
+        scb_index_free(&idx);
+    }
+    if (ret == 0 && opts->verbose)
+        printf(len <= ((size_t)1 << max_count * 8) ?
+               "Done (SECURE: %zu <= %zu).\n" :
+               "Done (INSECURE: %zu > %zu).\n",
+               len, (size_t)1 << max_count * 8);
+
+    scb_state_free(mem);
+    int unmap_ret = unmap_files(ptx_path, ptx, ctx_path, ctx, len, 0, head,
+                                opts);
+    ret = ret != 0 ? ret : unmap_ret;
+    free(ctx_path);
+
+    return ret;
+}
+
+// Decrypts `ctx_path`, which starts with a header of `head` bytes (already
+// checked), into `dec_path`, in chunks of `chunked` bytes unless 0.
+int decrypt_file_mapped(const uint8_t* key, size_t max_count, size_t max_hash,
+                        char* ctx_path, char* dec_path, size_t head,
+                        size_t chunked, const file_opts* opts)
+{
+    const uint8_t* ctx;
+    uint8_t* dec;
+    size_t len;
+    int ret = opts->in_place ? map_file(ctx_path, &dec, &len, true) :
+              map_files(ctx_path, &ctx, dec_path, &dec, &len, head, 0);
+    if (ret != 0)
+        return ret;
+    if (opts->in_place)
+        ctx = dec;
+
+    // The whole output is mapped, so the state may point into it.
+    scb_state mem = NULL;
+    bool ok = true;
+    if (opts->verbose)
+        printf("SCB decrypting ... ");
+    fflush(stdout);
+    if (chunked != 0)
+        scb_decrypt_chunked(key, ctx, dec, len, max_count, max_hash, chunked,
+                            0, opts->threads);
+    else if (opts->threads != 1)
+        ok = scb_decrypt_parallel(key, ctx, dec, len, max_count, max_hash,
+                                  &mem, opts->threads);
+    else
+        scb_decrypt(key, ctx, dec, len, max_count, max_hash, &mem);
+    if (!ok)
+        printf("Failed (%s).\n", strerror(ENOMEM));
+    else if (opts->verbose)
+        printf("Done.\n");
+
+    scb_state_free(mem);
+    if (ok)
+        return unmap_files(ctx_path, ctx, dec_path, dec, len, head, 0, opts);
+    unmap_failed(ctx, dec_path, dec, len, head, 0, opts);
+    return -6;
+}
+
+// Encrypts or decrypts in chunks of `chunked` bytes from `in_fd` to `w`,
+// the input starting with the `head_len` bytes of `head`, and adds the bytes
+// read to `len`. Whole chunks are processed (in parallel) as soon as one
+// more chunk and 16 bytes follow them, since the last chunk takes in a rest
+// of less than 16 bytes.
+bool chunked_stream(const uint8_t* key, size_t max_count, size_t max_hash,
+                    size_t chunked, int in_fd, const uint8_t* head,
+                    size_t head_len, writer* w, bool enc,
+                    const file_opts* opts, size_t* len)
+{
+    size_t batch = (opts->chunk + chunked - 1) / chunked * chunked;
+    size_t cap = batch + chunked + 16;
+    uint8_t* in = (uint8_t*)malloc(cap);
+    uint8_t* out[2] = { (uint8_t*)malloc(cap), (uint8_t*)malloc(cap) };
+    void (*run)(const uint8_t*, const uint8_t*, uint8_t*, size_t, size_t,
+                size_t, size_t, size_t, size_t) =
+        enc ? scb_encrypt_chunked : scb_decrypt_chunked;
+    memcpy(in, head, head_len * sizeof(uint8_t));
+    size_t held = head_len;
+    *len += head_len;
+    size_t first = 0;
+    size_t cur = 0;
+    ssize_t n;
+    while ((n = read_full(in_fd, in + held, cap - held)) > 0)
+    {
+        held += n;
+        *len += n;
+        if (held < cap)
+            break;
+        run(key, in, out[cur], batch, max_count, max_hash, chunked, first,
+            opts->threads);
+        writer_submit(w, out[cur], batch);
+        cur ^= 1;
+        first += batch / chunked;
+        held -= batch;
+        memmove(in, in + batch, held);
+    }
+    // Nothing shorter than a block is output, as by the stream.
+    if (n >= 0 && held >= 16)
+    {
+        run(key, in, out[cur], held, max_count, max_hash, chunked, first,
+            opts->threads);
+        writer_submit(w, out[cur], held);
+    }
+
+    // Waits for the last buffer submitted to be written.
+    writer_submit(w, NULL, 0);
+    free(in);
+    free(out[0]);
+    free(out[1]);
+    return n >= 0;
+}
+
 int encrypt_file(size_t max_count, size_t max_hash, char* key_path,
-                 char* ptx_path, bool verbose)
+                 char* ptx_path, const file_opts* opts)
 {
     if (max_count + max_hash > 16)
     {
@@ -22,71 +825,536 @@ int encrypt_file(size_t max_count, size_t max_hash, char* key_path,
     }
     
     uint8_t key[16];
-    FILE* key_file = fopen(key_path, "rb");
-    if (key_file == NULL)
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    if (opts->engine == ENGINE_EXT)
+        return encrypt_file_external(key, max_count, max_hash, ptx_path, opts);
+    if (opts->mmap || opts->in_place)
+        return encrypt_file_mapped(key, max_count, max_hash, ptx_path, opts);
+
+    scb_state mem = NULL;
+    ret = new_state(&mem, ptx_path, opts);
+    if (ret != 0)
+        return ret;
+
+    char* ctx_path = encrypted_path(ptx_path, max_count, max_hash);
+    int ptx_fd, ctx_fd;
+    ret = open_files(ptx_path, &ptx_fd, ctx_path, &ctx_fd);
+    if (ret != 0)
     {
-        printf("File \"%s\" not found.\n", key_path);
-        return -3;
+        scb_state_free(mem);
+        free(ctx_path);
+        return ret;
+    }
+
+    // The stream outputs at most 16 bytes more than it is fed, and two
+    // output buffers let one be written while the other is filled. The
+    // index needs the plaintext of each output too, so the (at most 32)
+    // bytes held back by the stream are kept in front of the next chunk.
+    uint8_t* ptx = (uint8_t*)malloc(opts->chunk + 32);
+    uint8_t* ctx[2] = { (uint8_t*)malloc(opts->chunk + 32),
+                        (uint8_t*)malloc(opts->chunk + 32) };
+    size_t held = 0;
+    scb_index idx;
+    scb_index_init(&idx);
+    bool indexed = true;
+    scb_stream s;
+    scb_encrypt_init(&s, key, max_count, max_hash, &mem);
+    s.sort = opts->engine == ENGINE_SORT;
+    s.threads = opts->threads;
+    uint8_t h[HEADER_LEN];
+    bool ok = true;
+    if (opts->header)
+    {
+        struct stat st;
+        fstat(ptx_fd, &st);
+        header_write(h, key, max_count, max_hash, st.st_size,
+                     opts->chunked);
+        ok = write_full(ctx_fd, h, HEADER_LEN);
+    }
+    writer w;
+    writer_open(&w, ctx_fd);
+
+    if (opts->verbose)
+        printf("SCB encrypting ... ");
+    fflush(stdout);
+    size_t len = 0;
+    size_t cur = 0;
+    ssize_t n = 0;
+    if (opts->chunked != 0)
+        ok &= chunked_stream(key, max_count, max_hash, opts->chunked, ptx_fd,
+                             h, 0, &w, true, opts, &len);
+    else if (opts->engine == ENGINE_PIPE)
+    {
+        // The pipeline writes on its own, after the header.
+        if (scb_encrypt_pipeline(key, ptx_fd, ctx_fd, max_count, max_hash,
+                                 opts->chunk, &mem, opts->threads, &len) != 0)
+            ok = false;
+    }
+    else
+    {
+        while ((n = read_full(ptx_fd, ptx + held, opts->chunk)) > 0)
+        {
+            len += n;
+            size_t m = scb_encrypt_update(&s, ptx + held, n, ctx[cur]);
+            if (opts->index)
+            {
+                indexed = indexed && scb_index_update(&idx, key, ptx, ctx[cur],
+                                                      m, max_hash, false);
+                held += n - m;
+                memmove(ptx, ptx + m, held);
+            }
+            writer_submit(&w, ctx[cur], m);
+            cur ^= 1;
+        }
+        size_t m = scb_encrypt_final(&s, ctx[cur]);
+        if (opts->index)
+            indexed = indexed && scb_index_update(&idx, key, ptx, ctx[cur], m,
+                                                  max_hash, true);
+        writer_submit(&w, ctx[cur], m);
+    }
+    ok &= writer_close(&w) && n == 0;
+    ret = close_files(ptx_path, ptx_fd, ctx_path, ctx_fd, len, ok);
+    if (ret == 0 && opts->index)
+        ret = write_index(ctx_path, &idx, indexed, max_count, max_hash, len);
+    if (ret == 0 && opts->verbose)
+        printf(len <= ((size_t)1 << max_count * 8) ?
+               "Done (SECURE: %zu <= %zu).\n" :
+               "Done (INSECURE: %zu > %zu).\n",
+               len, (size_t)1 << max_count * 8);
+
+    scb_index_free(&idx);
+    scb_state_free(mem);
+    free(ptx);
+    free(ctx[0]);
+    free(ctx[1]);
+    free(ctx_path);
+
+    return ret;
+}
+
+// State file of enc-append, next to the ciphertext: this header, the
+// encryption state as of some earlier run (see scb_state_save), and then the
+// state entries changed by every run since (see scb_state_save_delta). A run
+// appends its changes and then updates the header in place, so that it
+// writes as much as it encrypts, and only once the changes add up to more
+// than the state does it write the whole state again.
+typedef struct append_header
+{
+    char magic[8]; // "SCBAPP2"
+    size_t max_count;
+    size_t max_hash;
+    size_t done;   // Bytes of ciphertext that stay as they are
+    size_t len;    // Bytes of plaintext encrypted
+    size_t state;  // Bytes of the saved state
+    size_t deltas; // Bytes of the changes after it
+} append_header;
+
+// Encrypts what was appended to `ptx_path` since the last call, continuing
+// from the saved state. Only the ciphertext of the last (at most 32) bytes,
+// which depends on where the message ends, is rewritten, so the result
+// equals encrypting the whole file at once.
+int encrypt_file_append(size_t max_count, size_t max_hash, char* key_path,
+                        char* ptx_path, const file_opts* opts)
+{
+    if (max_count + max_hash > 16)
+    {
+        printf("Need max_count + max_hash <= 16.\n");
+        return -2;
+    }
+
+    uint8_t key[16];
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    char* ctx_path = encrypted_path(ptx_path, max_count, max_hash);
+    char* state_path = (char*)malloc((strlen(ctx_path) + 11) *
+                                     sizeof(*ctx_path));
+    strcpy(state_path, ctx_path);
+    strcat(state_path, ".state");
+    char* tmp_path = (char*)malloc((strlen(ctx_path) + 11) *
+                                   sizeof(*ctx_path));
+    strcpy(tmp_path, state_path);
+    strcat(tmp_path, ".tmp");
+
+    append_header h = { .magic = "SCBAPP2", .max_count = max_count,
+                        .max_hash = max_hash };
+    scb_state mem = NULL;
+    FILE* f = fopen(state_path, "r+b");
+    if (f != NULL)
+    {
+        // The state is mapped rather than read, so that only the parts of
+        // it needed by the appended blocks are loaded, and the changes of
+        // the runs since it was saved are applied to it. Changes of a run
+        // that did not finish, beyond those the header counts, are dropped.
+        append_header saved;
+        bool ok = fread(&saved, sizeof(saved), 1, f) == 1 &&
+                  !memcmp(&saved, &h, 8 + 2 * sizeof(size_t)) &&
+                  scb_state_map(&mem, state_path, sizeof(saved)) &&
+                  fseek(f, sizeof(saved) + saved.state, SEEK_SET) == 0;
+        while (ok && (size_t)ftell(f) < sizeof(saved) + saved.state +
+                                        saved.deltas)
+            ok = scb_state_load_delta(&mem, f);
+        long end = ftell(f);
+        ok = ok && (size_t)end == sizeof(saved) + saved.state + saved.deltas &&
+             fseek(f, end, SEEK_SET) == 0 && ftruncate(fileno(f), end) == 0;
+        if (!ok)
+        {
+            printf("File \"%s\" is not a state for these parameters.\n",
+                   state_path);
+            ret = -5;
+        }
+        else
+            h = saved;
+    }
+
+    int ptx_fd = -1;
+    int ctx_fd = -1;
+    struct stat st;
+    if (ret == 0 && (ptx_fd = open(ptx_path, O_RDONLY)) < 0)
+    {
+        printf("File \"%s\" not found.\n", ptx_path);
+        ret = -5;
+    }
+    if (ret == 0 && (fstat(ptx_fd, &st) != 0 || (size_t)st.st_size < h.len))
+    {
+        printf("File \"%s\" is shorter than when last encrypted.\n",
+               ptx_path);
+        ret = -5;
+    }
+    if (ret == 0 && (size_t)st.st_size < 16)
+    {
+        printf("File \"%s\" must contain at least 16 bytes.\n", ptx_path);
+        ret = -5;
+    }
+    if (ret == 0 &&
+        ((ctx_fd = open(ctx_path, O_WRONLY | O_CREAT, 0644)) < 0 ||
+         ftruncate(ctx_fd, h.done) != 0 ||
+         lseek(ctx_fd, h.done, SEEK_SET) < 0 ||
+         lseek(ptx_fd, h.done, SEEK_SET) < 0))
+    {
+        printf("File \"%s\" cannot be written.\n", ctx_path);
+        ret = -6;
+    }
+    if (ret != 0)
+    {
+        if (ptx_fd >= 0)
+            close(ptx_fd);
+        if (ctx_fd >= 0)
+            close(ctx_fd);
+        if (f != NULL)
+            fclose(f);
+        scb_state_free(mem);
+        free(ctx_path);
+        free(state_path);
+        free(tmp_path);
+        return ret;
+    }
+
+    // As in encrypt_file_update, the plaintext of each output is kept for
+    // the changes it made to the state.
+    bool compact = f == NULL || h.deltas > h.state;
+    uint8_t* ptx = (uint8_t*)malloc(opts->chunk + 32);
+    uint8_t* ctx[2] = { (uint8_t*)malloc(opts->chunk + 32),
+                        (uint8_t*)malloc(opts->chunk + 32) };
+    size_t held = 0;
+    scb_stream s;
+    scb_encrypt_init(&s, key, max_count, max_hash, &mem);
+    s.sort = opts->engine == ENGINE_SORT;
+    s.threads = opts->threads;
+    writer w;
+    writer_open(&w, ctx_fd);
+
+    if (opts->verbose)
+        printf("SCB encrypting %zu appended bytes ... ",
+               (size_t)st.st_size - h.len);
+    fflush(stdout);
+    bool ok = true;
+    size_t len = h.done;
+    size_t done = h.done;
+    size_t cur = 0;
+    ssize_t n;
+    while ((n = read_full(ptx_fd, ptx + held, opts->chunk)) > 0)
+    {
+        len += n;
+        size_t m = scb_encrypt_update(&s, ptx + held, n, ctx[cur]);
+        if (!compact && m > 0)
+            ok &= scb_state_save_delta(mem, ptx, m, max_hash, f);
+        done += m;
+        held += n - m;
+        memmove(ptx, ptx + m, held);
+        writer_submit(&w, ctx[cur], m);
+        cur ^= 1;
+    }
+
+    // The state is saved before the end of the message is encrypted, and
+    // counts only once the ciphertext is on disk (when the header is updated
+    // or the new state file replaces the old one), so that an interrupted
+    // run is simply repeated.
+    h.done = done;
+    h.len = len;
+    if (compact)
+    {
+        if (f != NULL)
+            fclose(f);
+        f = fopen(tmp_path, "wb");
+        ok &= f != NULL && fwrite(&h, sizeof(h), 1, f) == 1 &&
+              scb_state_save(mem, f);
+        h.state = f != NULL ? ftell(f) - sizeof(h) : 0;
+        h.deltas = 0;
+    }
+    else
+        h.deltas = ftell(f) - sizeof(h) - h.state;
+    ok &= f != NULL && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    writer_submit(&w, ctx[cur], scb_encrypt_final(&s, ctx[cur]));
+    ok &= writer_close(&w) && n == 0 && fsync(ctx_fd) == 0;
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+         fwrite(&h, sizeof(h), 1, f) == 1 && fflush(f) == 0 &&
+         fsync(fileno(f)) == 0;
+    if (f != NULL)
+        ok &= fclose(f) == 0;
+    ok = ok && (!compact || rename(tmp_path, state_path) == 0);
+    if (!ok)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        if (compact)
+            unlink(tmp_path);
+        ret = -6;
+    }
+    else if (opts->verbose)
+        printf(len <= ((size_t)1 << max_count * 8) ?
+               "Done (SECURE: %zu <= %zu).\n" :
+               "Done (INSECURE: %zu > %zu).\n",
+               len, (size_t)1 << max_count * 8);
+
+    close(ptx_fd);
+    close(ctx_fd);
+    scb_state_free(mem);
+    free(ptx);
+    free(ctx[0]);
+    free(ctx[1]);
+    free(ctx_path);
+    free(state_path);
+    free(tmp_path);
+
+    return ret;
+}
+
+// Checkpoint file of enc with the option checkpoint and of enc-update,
+// next to the ciphertext: this header, then about every `interval` bytes a
+// checkpoint_record followed by the state entries changed since the last
+// one (see scb_state_save_delta).
+typedef struct checkpoint_header
+{
+    char magic[8]; // "SCBCKP1"
+    size_t max_count;
+    size_t max_hash;
+    size_t interval;
+} checkpoint_header;
+
+typedef struct checkpoint_record
+{
+    size_t done;       // Bytes of ciphertext that stay as they are
+    uint8_t digest[SHA256_DIGEST_LENGTH]; // Of the plaintext since the last
+} checkpoint_record;
+
+// Encrypts `ptx_path` with checkpoints. With `update`, the checkpoints of the
+// previous encryption whose plaintext has not changed since are restored
+// first, and only the rest is encrypted again (as are the last 32 bytes
+// before it), so the result equals encrypting the whole file at once.
+int encrypt_file_update(size_t max_count, size_t max_hash, char* key_path,
+                        char* ptx_path, bool update, const file_opts* opts)
+{
+    if (max_count + max_hash > 16)
+    {
+        printf("Need max_count + max_hash <= 16.\n");
+        return -2;
+    }
+
+    uint8_t key[16];
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    char* ctx_path = encrypted_path(ptx_path, max_count, max_hash);
+    char* ckpt_path = (char*)malloc((strlen(ctx_path) + 6) *
+                                    sizeof(*ctx_path));
+    strcpy(ckpt_path, ctx_path);
+    strcat(ckpt_path, ".ckpt");
+    int ptx_fd = open(ptx_path, O_RDONLY);
+    if (ptx_fd < 0)
+    {
+        printf("File \"%s\" not found.\n", ptx_path);
+        free(ctx_path);
+        free(ckpt_path);
+        return -5;
+    }
+
+    checkpoint_header h = { .magic = "SCBCKP1", .max_count = max_count,
+                            .max_hash = max_hash,
+                            .interval = opts->checkpoint };
+    FILE* f = update ? fopen(ckpt_path, "r+b") : NULL;
+    scb_state mem = NULL;
+    size_t done = 0;
+    uint8_t* ptx = NULL;
+    if (f != NULL)
+    {
+        checkpoint_header saved;
+        if (fread(&saved, sizeof(saved), 1, f) != 1 ||
+            memcmp(&saved, &h, 8 + 2 * sizeof(size_t)) || saved.interval == 0)
+        {
+            printf("File \"%s\" is not a checkpoint file for these " \
+                   "parameters.\n", ckpt_path);
+            ret = -5;
+        }
+        else
+            h = saved;
+
+        // Checkpoints count as long as the plaintext before them is the
+        // same, and their ciphertext has been written.
+        struct stat st;
+        size_t ctx_len = stat(ctx_path, &st) == 0 ? (size_t)st.st_size : 0;
+        ptx = (uint8_t*)malloc(h.interval + 32);
+        long keep = ftell(f);
+        checkpoint_record r;
+        while (ret == 0 && fread(&r, sizeof(r), 1, f) == 1 &&
+               r.done > done && r.done - done <= h.interval + 32 &&
+               r.done <= ctx_len)
+        {
+            uint8_t digest[SHA256_DIGEST_LENGTH];
+            ssize_t n = read_full(ptx_fd, ptx, r.done - done);
+            if (n != (ssize_t)(r.done - done) ||
+                memcmp(SHA256(ptx, n, digest), r.digest, sizeof(digest)))
+                break;
+            if (!scb_state_load_delta(&mem, f))
+            {
+                printf("File \"%s\" is corrupted.\n", ckpt_path);
+                ret = -5;
+            }
+            done = r.done;
+            keep = ftell(f);
+        }
+        if (ret == 0 && (fflush(f) != 0 || ftruncate(fileno(f), keep) != 0 ||
+                         fseek(f, keep, SEEK_SET) != 0))
+        {
+            printf("File \"%s\" cannot be written.\n", ckpt_path);
+            ret = -6;
+        }
+    }
+    else if (update && opts->checkpoint == 0)
+    {
+        printf("File \"%s\" not found (encrypt with checkpoint=SIZE " \
+               "first).\n", ckpt_path);
+        ret = -5;
+    }
+    else
+    {
+        f = fopen(ckpt_path, "wb");
+        if (f == NULL || fwrite(&h, sizeof(h), 1, f) != 1)
+        {
+            printf("File \"%s\" cannot be written.\n", ckpt_path);
+            ret = -6;
+        }
+        ptx = (uint8_t*)malloc(h.interval + 32);
+    }
+
+    int ctx_fd = -1;
+    struct stat st;
+    if (ret == 0 && (fstat(ptx_fd, &st) != 0 || st.st_size < 16))
+    {
+        printf("File \"%s\" must contain at least 16 bytes.\n", ptx_path);
+        ret = -5;
+    }
+    if (ret == 0 &&
+        ((ctx_fd = open(ctx_path, O_WRONLY | O_CREAT, 0644)) < 0 ||
+         ftruncate(ctx_fd, done) != 0 ||
+         lseek(ctx_fd, done, SEEK_SET) < 0 ||
+         lseek(ptx_fd, done, SEEK_SET) < 0))
+    {
+        printf("File \"%s\" cannot be written.\n", ctx_path);
+        ret = -6;
     }
-    fseek(key_file, 0, SEEK_END);
-    size_t len = ftell(key_file);
-    fseek(key_file, 0, SEEK_SET);
-    if (len < 16)
+    if (ret != 0)
     {
-        printf("File \"%s\" must contain at least 16 bytes.\n", key_path);
-        return -4;
+        close(ptx_fd);
+        if (ctx_fd >= 0)
+            close(ctx_fd);
+        if (f != NULL)
+            fclose(f);
+        scb_state_free(mem);
+        free(ptx);
+        free(ctx_path);
+        free(ckpt_path);
+        return ret;
     }
-    fread(key, sizeof(uint8_t), 16, key_file);
-    fclose(key_file);
 
-    FILE* ptx_file = fopen(ptx_path, "rb");
-    if (ptx_file == NULL)
+    // As in encrypt_file with the option index, the plaintext of each
+    // output is kept for its checkpoint.
+    uint8_t* ctx[2] = { (uint8_t*)malloc(h.interval + 32),
+                        (uint8_t*)malloc(h.interval + 32) };
+    size_t held = 0;
+    scb_stream s;
+    scb_encrypt_init(&s, key, max_count, max_hash, &mem);
+    s.sort = opts->engine == ENGINE_SORT;
+    s.threads = opts->threads;
+    writer w;
+    writer_open(&w, ctx_fd);
+
+    if (opts->verbose)
+        printf("SCB encrypting from byte %zu ... ", done);
+    fflush(stdout);
+    bool ok = true;
+    size_t len = done;
+    size_t cur = 0;
+    ssize_t n;
+    while ((n = read_full(ptx_fd, ptx + held, h.interval)) > 0)
     {
-        printf("File \"%s\" not found.\n", ptx_path);
-        return -5;
+        len += n;
+        size_t m = scb_encrypt_update(&s, ptx + held, n, ctx[cur]);
+        if (m > 0)
+        {
+            checkpoint_record r = { .done = done + m };
+            SHA256(ptx, m, r.digest);
+            ok &= fwrite(&r, sizeof(r), 1, f) == 1 &&
+                  scb_state_save_delta(mem, ptx, m, max_hash, f);
+        }
+        done += m;
+        held += n - m;
+        memmove(ptx, ptx + m, held);
+        writer_submit(&w, ctx[cur], m);
+        cur ^= 1;
     }
-    fseek(ptx_file, 0, SEEK_END);
-    len = ftell(ptx_file);
-    fseek(ptx_file, 0, SEEK_SET);
-    uint8_t* ptx = (uint8_t*)malloc(len);
-    fread(ptx, sizeof(*ptx), len, ptx_file);
-    fclose(ptx_file);
-    
-    uint8_t* ctx = (uint8_t*)malloc(len);
-    scb_state mem = NULL;
-    if (verbose)
-        printf("SCB encrypting ... ");
-    scb_encrypt(key, ptx, ctx, len, max_count, max_hash, &mem);
-    if (verbose)
+    writer_submit(&w, ctx[cur], scb_encrypt_final(&s, ctx[cur]));
+    ok &= writer_close(&w) && n == 0;
+    ok &= fclose(f) == 0;
+    if (!ok)
+    {
+        printf("Failed (%s).\n", strerror(errno));
+        ret = -6;
+    }
+    else if (opts->verbose)
         printf(len <= ((size_t)1 << max_count * 8) ?
                "Done (SECURE: %zu <= %zu).\n" :
                "Done (INSECURE: %zu > %zu).\n",
                len, (size_t)1 << max_count * 8);
-    
-    char* ctx_path = (char*)malloc((strlen(ptx_path) + 10) * sizeof(*ptx_path));
-    char max_count_str[2];
-    char max_hash_str[2];
-    sprintf(max_count_str, "%zu", max_count);
-    sprintf(max_hash_str, "%zu", max_hash);
-    strcpy(ctx_path, ptx_path);
-    strcat(ctx_path, ".enc_");
-    strcat(ctx_path, max_count_str);
-    strcat(ctx_path, "_");
-    strcat(ctx_path, max_hash_str);
-
-    FILE* ctx_file = fopen(ctx_path, "wb");
-    fwrite(ctx, sizeof(*ctx), len, ctx_file);
-    fclose(ctx_file);
 
+    close(ptx_fd);
+    close(ctx_fd);
+    scb_state_free(mem);
     free(ptx);
-    free(ctx);
+    free(ctx[0]);
+    free(ctx[1]);
     free(ctx_path);
+    free(ckpt_path);
 
-    return 0;
+    return ret;
 }
 
 int encrypt_file_check(size_t max_count, size_t max_hash, char* key_path,
-                       char* ptx_path)
+                       char* ptx_path, const file_opts* opts)
 {
     if (max_count + max_hash > 16)
     {
@@ -95,164 +1363,991 @@ int encrypt_file_check(size_t max_count, size_t max_hash, char* key_path,
     }
     
     uint8_t key[16];
-    FILE* key_file = fopen(key_path, "rb");
-    if (key_file == NULL)
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    char* ctx_path = encrypted_path(ptx_path, max_count, max_hash);
+    int ptx_fd, ctx_fd;
+    ret = open_files(ptx_path, &ptx_fd, ctx_path, &ctx_fd);
+    if (ret != 0)
     {
-        printf("File \"%s\" not found.\n", key_path);
-        return -3;
+        free(ctx_path);
+        return ret;
     }
-    fseek(key_file, 0, SEEK_END);
-    size_t len = ftell(key_file);
-    fseek(key_file, 0, SEEK_SET);
-    if (len < 16)
+
+    // Each ciphertext chunk is decrypted right away and compared with the
+    // plaintext it came from. Decryption lags at most 32 bytes behind, so
+    // the pending plaintext fits in a buffer slightly larger than a chunk.
+    uint8_t* ptx = (uint8_t*)malloc(opts->chunk + 64);
+    uint8_t* ctx[2] = { (uint8_t*)malloc(opts->chunk + 32),
+                        (uint8_t*)malloc(opts->chunk + 32) };
+    uint8_t* dec_out = (uint8_t*)malloc(opts->chunk + 64);
+    size_t pending = 0;
+    size_t errors = 0;
+    scb_state mem_enc = NULL;
+    scb_state mem_dec = NULL;
+    scb_stream enc, dec;
+    scb_encrypt_init(&enc, key, max_count, max_hash, &mem_enc);
+    scb_decrypt_init_copy(&dec, key, max_count, max_hash, &mem_dec);
+    enc.sort = opts->engine == ENGINE_SORT;
+    enc.threads = dec.threads = opts->threads;
+    uint8_t h[HEADER_LEN];
+    bool ok = true;
+    if (opts->header)
     {
-        printf("File \"%s\" must contain at least 16 bytes.\n", key_path);
-        return -4;
+        struct stat st;
+        fstat(ptx_fd, &st);
+        header_write(h, key, max_count, max_hash, st.st_size, 0);
+        ok = write_full(ctx_fd, h, HEADER_LEN);
     }
-    fread(key, sizeof(uint8_t), 16, key_file);
-    fclose(key_file);
+    writer w;
+    writer_open(&w, ctx_fd);
 
-    FILE* ptx_file = fopen(ptx_path, "rb");
-    if (ptx_file == NULL)
+    printf("SCB encrypting ... ");
+    fflush(stdout);
+    size_t len = 0;
+    size_t cur = 0;
+    ssize_t n;
+    while (true)
     {
-        printf("File \"%s\" not found.\n", ptx_path);
-        return -5;
+        n = read_full(ptx_fd, ptx + pending, opts->chunk);
+        size_t m = n > 0 ? scb_encrypt_update(&enc, ptx + pending, n, ctx[cur])
+                         : scb_encrypt_final(&enc, ctx[cur]);
+        pending += n > 0 ? n : 0;
+        len += n > 0 ? n : 0;
+        size_t k = scb_decrypt_update(&dec, ctx[cur], m, dec_out);
+        if (n <= 0)
+            k += scb_decrypt_final(&dec, dec_out + k);
+        errors += block_diff(ptx, dec_out, k);
+        pending -= k;
+        memmove(ptx, ptx + k, pending);
+        writer_submit(&w, ctx[cur], m);
+        cur ^= 1;
+        if (n <= 0)
+            break;
     }
-    fseek(ptx_file, 0, SEEK_END);
-    len = ftell(ptx_file);
-    fseek(ptx_file, 0, SEEK_SET);
-    uint8_t* ptx = (uint8_t*)malloc(len);
-    fread(ptx, sizeof(*ptx), len, ptx_file);
-    fclose(ptx_file);
-    
-    uint8_t* ctx = (uint8_t*)malloc(len);
-    uint8_t* dec = (uint8_t*)malloc(len);
-    scb_state mem_enc = NULL;
-    scb_state mem_dec = NULL;
-    printf("SCB encrypting ... ");
-    scb_encrypt(key, ptx, ctx, len, max_count, max_hash, &mem_enc);
-    scb_decrypt(key, ctx, dec, len, max_count, max_hash, &mem_dec);
-    printf(len <= ((size_t)1 << max_count * 8) ?
-           "Done (SECURE: %zu <= %zu; ERRORS: %zu).\n" :
-           "Done (INSECURE: %zu > %zu; ERRORS: %zu).\n",
-           len, (size_t)1 << max_count * 8, block_diff(ptx, dec, len));
-    
-    char* ctx_path = (char*)malloc((strlen(ptx_path) + 10) * sizeof(*ptx_path));
-    char max_count_str[2];
-    char max_hash_str[2];
-    sprintf(max_count_str, "%zu", max_count);
-    sprintf(max_hash_str, "%zu", max_hash);
-    strcpy(ctx_path, ptx_path);
-    strcat(ctx_path, ".enc_");
-    strcat(ctx_path, max_count_str);
-    strcat(ctx_path, "_");
-    strcat(ctx_path, max_hash_str);
-
-    FILE* ctx_file = fopen(ctx_path, "wb");
-    fwrite(ctx, sizeof(*ctx), len, ctx_file);
-    fclose(ctx_file);
+    ok &= writer_close(&w) && n == 0;
+    ret = close_files(ptx_path, ptx_fd, ctx_path, ctx_fd, len, ok);
+    if (ret == 0)
+        printf(len <= ((size_t)1 << max_count * 8) ?
+               "Done (SECURE: %zu <= %zu; ERRORS: %zu).\n" :
+               "Done (INSECURE: %zu > %zu; ERRORS: %zu).\n",
+               len, (size_t)1 << max_count * 8, errors);
 
+    scb_state_free(mem_enc);
+    scb_state_free(mem_dec);
     free(ptx);
-    free(ctx);
-    free(dec);
+    free(ctx[0]);
+    free(ctx[1]);
+    free(dec_out);
     free(ctx_path);
     
-    return 0;
+    return ret;
 }
 
+// Decrypts `ctx_path`, configured by its header if it has one (in which
+// case `max_count` and `max_hash` may be 0).
 int decrypt_file(size_t max_count, size_t max_hash, char* key_path,
-                 char* ctx_path, bool verbose)
+                 char* ctx_path, const file_opts* opts)
 {
-    if (max_count + max_hash > 16)
+    uint8_t key[16];
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    // The header is checked before anything is written.
+    int ctx_fd;
+    ret = open_input(ctx_path, &ctx_fd);
+    if (ret != 0)
+        return ret;
+    uint8_t h[HEADER_LEN];
+    size_t h_len;
+    size_t expected;
+    size_t chunked = opts->chunked;
+    ret = header_read(ctx_fd, ctx_path, key, &max_count, &max_hash, &expected,
+                      &chunked, h, &h_len);
+    if (ret == 0 && max_count + max_hash > 16)
     {
         printf("Need max_count + max_hash <= 16.\n");
-        return -2;
+        ret = -2;
     }
-
-    uint8_t key[16];
-    FILE* key_file = fopen(key_path, "rb");
-    if (key_file == NULL)
+    if (ret == 0 && expected != SIZE_MAX && opts->in_place)
     {
-        printf("File \"%s\" not found.\n", key_path);
-        return -3;
+        printf("inplace is not supported for files with a header.\n");
+        ret = -1;
     }
-    fseek(key_file, 0, SEEK_END);
-    size_t len = ftell(key_file);
-    fseek(key_file, 0, SEEK_SET);
-    if (len < 16)
+    if (ret == 0 && chunked != 0 && opts->dec_budget != 0)
     {
-        printf("File \"%s\" must contain at least 16 bytes.\n", key_path);
-        return -4;
+        printf("mem is not supported for chunked files.\n");
+        ret = -1;
+    }
+    if (ret != 0)
+    {
+        close(ctx_fd);
+        return ret;
     }
-    fread(key, sizeof(uint8_t), 16, key_file);
-    fclose(key_file);
 
-    FILE* ctx_file = fopen(ctx_path, "rb");
-    if (ctx_file == NULL)
+    char* dec_path = (char*)malloc((strlen(ctx_path) + 5) * sizeof(*ctx_path));
+    strcpy(dec_path, ctx_path);
+    if (strcmp(ctx_path, "-"))
+        strcat(dec_path, ".dec");
+    if (opts->mmap || opts->in_place)
     {
-        printf("File \"%s\" not found.\n", ctx_path);
-        return -5;
+        close(ctx_fd);
+        ret = decrypt_file_mapped(key, max_count, max_hash, ctx_path, dec_path,
+                                  expected == SIZE_MAX ? 0 : HEADER_LEN,
+                                  chunked, opts);
+        free(dec_path);
+        return ret;
     }
-    fseek(ctx_file, 0, SEEK_END);
-    len = ftell(ctx_file);
-    fseek(ctx_file, 0, SEEK_SET);
-    uint8_t* ctx = (uint8_t*)malloc(len);
-    fread(ctx, sizeof(*ctx), len, ctx_file);
-    fclose(ctx_file);
-    
-    uint8_t* dec = (uint8_t*)malloc(len);
     scb_state mem = NULL;
-    if (verbose)
+    if (opts->dec_budget != 0 && !scb_state_new_budget(&mem, opts->dec_budget))
+    {
+        printf("mem must be at least a few kilobytes.\n");
+        ret = -1;
+    }
+    int dec_fd;
+    if (ret == 0)
+        ret = open_output(dec_path, &dec_fd);
+    if (ret != 0)
+    {
+        scb_state_free(mem);
+        close(ctx_fd);
+        free(dec_path);
+        return ret;
+    }
+
+    uint8_t* ctx = (uint8_t*)malloc(opts->chunk);
+    uint8_t* dec[2] = { (uint8_t*)malloc(opts->chunk + 32),
+                        (uint8_t*)malloc(opts->chunk + 32) };
+    scb_stream s;
+    scb_decrypt_init_copy(&s, key, max_count, max_hash, &mem);
+    s.threads = opts->threads;
+    writer w;
+    writer_open(&w, dec_fd);
+
+    if (opts->verbose)
         printf("SCB decrypting ... ");
-    scb_decrypt(key, ctx, dec, len, max_count, max_hash, &mem);
-    if (verbose)
+    fflush(stdout);
+    // Without header, the bytes read looking for it are the start of the
+    // ciphertext. They are no more than the stream holds back, so nothing
+    // is output yet.
+    size_t len = 0;
+    size_t cur = 0;
+    ssize_t n = 0;
+    bool ok = true;
+    if (chunked != 0)
+        ok = chunked_stream(key, max_count, max_hash, chunked, ctx_fd, h,
+                            h_len, &w, false, opts, &len);
+    else
+    {
+        len = h_len;
+        scb_decrypt_update(&s, h, h_len, dec[0]);
+        while ((n = read_full(ctx_fd, ctx, opts->chunk)) > 0)
+        {
+            len += n;
+            writer_submit(&w, dec[cur],
+                          scb_decrypt_update(&s, ctx, n, dec[cur]));
+            cur ^= 1;
+        }
+        writer_submit(&w, dec[cur], scb_decrypt_final(&s, dec[cur]));
+    }
+    ok &= writer_close(&w) && n == 0;
+    ret = close_files(ctx_path, ctx_fd, dec_path, dec_fd, len, ok);
+    if (ret == 0 && expected != SIZE_MAX && len != expected)
+    {
+        // Only possible from standard input, regular files are checked
+        // against the header up front.
+        printf("File \"%s\" should contain %zu bytes after the header.\n",
+               ctx_path, expected);
+        ret = -5;
+    }
+    size_t evictions, unresolved;
+    bool exact = scb_state_budget_stats(mem, &evictions, &unresolved);
+    if (ret == 0 && opts->verbose && opts->dec_budget != 0)
+        printf("Done (%zu of %zu blocks evicted, %s%zu repeat blocks " \
+               "unresolved).\n", evictions, len / 16,
+               exact ? "" : "at least ", unresolved);
+    else if (ret == 0 && opts->verbose)
         printf("Done.\n");
-    
-    char* dec_path = (char*)malloc((strlen(ctx_path) + 5) * sizeof(*ctx_path));
-    strcpy(dec_path, ctx_path);
-    strcat(dec_path, ".dec");
-    
-    FILE* dec_file = fopen(dec_path, "wb");
-    fwrite(dec, sizeof(*dec), len, dec_file);
-    fclose(dec_file);
 
+    scb_state_free(mem);
     free(ctx);
-    free(dec);
+    free(dec[0]);
+    free(dec[1]);
     free(dec_path);
 
+    return ret;
+}
+
+// Decrypts the chunks of `ctx` (of `len` bytes, in chunks of `chunked`
+// bytes) that cover a byte range, a batch of them at a time, and writes the
+// range to standard output.
+bool decrypt_range_chunked(const uint8_t* key, const uint8_t* ctx, size_t len,
+                           size_t max_count, size_t max_hash, size_t chunked,
+                           size_t offset, size_t end, const file_opts* opts)
+{
+    size_t count = scb_chunk_count(len, chunked);
+    size_t batch = opts->chunk > chunked ? opts->chunk / chunked : 1;
+    uint8_t* ptx = (uint8_t*)malloc(batch * chunked + 16);
+    // A rest of less than 16 bytes belongs to the last chunk.
+    size_t c = offset / chunked < count ? offset / chunked : count - 1;
+    bool ok = true;
+    for (; ok && offset < end; c += batch)
+    {
+        size_t from = c * chunked;
+        size_t to = c + batch >= count ? len : (c + batch) * chunked;
+        scb_decrypt_chunked(key, ctx + from, ptx, to - from, max_count,
+                            max_hash, chunked, c, opts->threads);
+        size_t n = (end < to ? end : to) - offset;
+        ok = write_full(stdout_fd, ptx + offset - from, n);
+        offset += n;
+    }
+    free(ptx);
+    return ok;
+}
+
+// Decrypts a byte range of `ctx_path` to standard output, using the index
+// written by enc with the option index (not needed for chunked files).
+int decrypt_range(size_t max_count, size_t max_hash, char* key_path,
+                  char* ctx_path, const file_opts* opts)
+{
+    uint8_t key[16];
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    uint8_t* map;
+    size_t map_len;
+    ret = map_file(ctx_path, &map, &map_len, false);
+    if (ret != 0)
+        return ret;
+
+    // A header configures the parameters and is skipped.
+    const uint8_t* ctx = map;
+    size_t len = map_len;
+    size_t chunked = opts->chunked;
+    if (header_present(map, map_len))
+    {
+        size_t expected;
+        ret = header_check(map, ctx_path, key, &max_count, &max_hash,
+                           &expected, &chunked);
+        ctx += HEADER_LEN;
+        len -= HEADER_LEN;
+        if (ret == 0 && len != expected)
+        {
+            printf("File \"%s\" should contain %zu bytes after the " \
+                   "header.\n", ctx_path, expected);
+            ret = -5;
+        }
+    }
+    else if (max_count == 0 || max_hash == 0)
+    {
+        printf("File \"%s\" has no header, so max_count and max_hash " \
+               "must be given.\n", ctx_path);
+        ret = -2;
+    }
+    if (ret == 0 && max_count + max_hash > 16)
+    {
+        printf("Need max_count + max_hash <= 16.\n");
+        ret = -2;
+    }
+    if (ret == 0 && (opts->offset > len ||
+        (opts->length != SIZE_MAX && opts->length > len - opts->offset)))
+    {
+        printf("The range exceeds the %zu bytes of \"%s\".\n", len,
+               ctx_path);
+        ret = -5;
+    }
+    if (ret == 0 && chunked != 0)
+    {
+        size_t end = opts->length == SIZE_MAX ? len :
+                     opts->offset + opts->length;
+        if (!decrypt_range_chunked(key, ctx, len, max_count, max_hash,
+                                   chunked, opts->offset, end, opts))
+        {
+            printf("Failed (%s).\n", strerror(errno));
+            ret = -6;
+        }
+        munmap(map, map_len);
+        return ret;
+    }
+    if (ret != 0)
+    {
+        munmap(map, map_len);
+        return ret;
+    }
+
+    char* idx_path = index_path(ctx_path);
+    uint8_t* idx_buf;
+    size_t idx_len;
+    ret = map_file(idx_path, &idx_buf, &idx_len, false);
+    if (ret != 0)
+    {
+        munmap(map, map_len);
+        free(idx_path);
+        return ret;
+    }
+
+    const index_header* h = (const index_header*)idx_buf;
+    if (idx_len < sizeof(*h) || strcmp(h->magic, "SCBIDX1") ||
+        h->max_count != max_count || h->max_hash != max_hash ||
+        h->len != len || idx_len != sizeof(*h) + h->n * 2 * sizeof(size_t))
+    {
+        printf("File \"%s\" is not the index of \"%s\" for these " \
+               "parameters.\n", idx_path, ctx_path);
+        ret = -5;
+    }
+    else
+    {
+        scb_index idx = { .entries = (size_t*)(idx_buf + sizeof(*h)),
+                          .n = h->n, .cap = h->n, .blocks = 0 };
+        size_t end = opts->length == SIZE_MAX ? len :
+                     opts->offset + opts->length;
+        uint8_t* ptx = (uint8_t*)malloc(opts->chunk);
+        bool ok = true;
+        for (size_t i = opts->offset; ok && i < end; i += opts->chunk)
+        {
+            size_t n = end - i < opts->chunk ? end - i : opts->chunk;
+            scb_decrypt_range(key, ctx, len, max_count, max_hash, &idx, i, n,
+                              ptx);
+            ok = write_full(stdout_fd, ptx, n);
+        }
+        if (!ok)
+        {
+            printf("Failed (%s).\n", strerror(errno));
+            ret = -6;
+        }
+        free(ptx);
+    }
+
+    munmap(map, map_len);
+    munmap(idx_buf, idx_len);
+    free(idx_path);
+    return ret;
+}
+
+// Prints a size in bytes in megabytes.
+void print_size(const char* what, size_t size, const char* note)
+{
+    printf("  %-24s %12.1f MB%s\n", what, size / (double)(1 << 20), note);
+}
+
+// Estimates the state memory and time it takes to encrypt and decrypt
+// `ptx_path`, from a sample of its blocks.
+int plan_file(size_t max_count, size_t max_hash, char* key_path,
+              char* ptx_path, const file_opts* opts)
+{
+    if (max_count + max_hash > 16)
+    {
+        printf("Need max_count + max_hash <= 16.\n");
+        return -2;
+    }
+
+    uint8_t key[16];
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    uint8_t* ptx;
+    size_t len;
+    ret = map_file(ptx_path, &ptx, &len, false);
+    if (ret != 0)
+        return ret;
+
+    scb_estimate est;
+    bool ok = scb_estimate_input(key, ptx, len, max_count, max_hash,
+                                 opts->samples, opts->threads, &est);
+    munmap(ptx, len);
+    if (!ok)
+    {
+        printf("Failed (%s).\n", strerror(ENOMEM));
+        return -6;
+    }
+
+    printf("%zu blocks, %zu sampled%s.\n", est.blocks, est.sampled,
+           est.sampled < est.blocks ? "" : " (exact)");
+    printf("About %zu distinct blocks, the most frequent one repeated " \
+           "about %zu times.\n", est.distinct, est.repeats);
+    if (max_count < 8 && est.repeats >> max_count * 8 != 0)
+        printf("Warning: repeats exceed what max_count = %zu can count.\n",
+               max_count);
+
+    printf("State memory:\n");
+    print_size("enc", est.enc_bytes, "");
+    print_size("enc table=DIR", est.enc_bytes, " (in a file)");
+    print_size("dec", est.dec_bytes, "");
+    print_size("dec without evictions", est.budget_bytes, " (mem=SIZE)");
+    print_size("index", est.index_bytes, " (in a file)");
+
+    printf("Throughput on the sample (lower with larger states):\n");
+    double rates[2] = { est.enc_rate, est.dec_rate };
+    for (size_t i = 0; i < 2; ++i)
+        printf("  %-24s %12.1f MB/s, about %.0f s for the file\n",
+               i == 0 ? "enc" : "dec", rates[i] / (1 << 20),
+               rates[i] > 0 ? len / rates[i] : 0);
     return 0;
 }
 
+typedef struct batch_file
+{
+    char* path;
+    size_t base_len; // Length of the path without the `.enc_X_Y` suffix
+} batch_file;
+
+typedef struct batch
+{
+    const uint8_t* key;
+    size_t max_count;
+    size_t max_hash;
+    bool enc;
+    const file_opts* opts;
+    batch_file* files;
+    size_t n;
+    size_t cap;
+    atomic_size_t next;
+    atomic_size_t failed;
+    scb_state shared; // Used by all files with state=shared
+} batch;
+
+// Collects the regular files below `dir` whose names do not contain
+// `suffix` (if `enc`, else end with it). Entries that cannot be stat'ed are
+// skipped.
+bool batch_collect(batch* b, const char* dir, const char* suffix)
+{
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return false;
+
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL)
+    {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        size_t len = strlen(dir) + strlen(e->d_name) + 1;
+        char* path = (char*)malloc((len + 1) * sizeof(*path));
+        sprintf(path, "%s/%s", dir, e->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) != 0)
+        {
+            free(path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+            batch_collect(b, path, suffix);
+        if (!S_ISREG(st.st_mode))
+        {
+            free(path);
+            continue;
+        }
+        size_t slen = strlen(suffix);
+        bool ends = len > slen && !strcmp(path + len - slen, suffix);
+        if (b->enc ? strstr(e->d_name, suffix) != NULL : !ends)
+        {
+            free(path);
+            continue;
+        }
+
+        if (b->n == b->cap)
+        {
+            b->cap = b->cap == 0 ? 64 : b->cap * 2;
+            b->files = (batch_file*)realloc(b->files,
+                                            b->cap * sizeof(*b->files));
+        }
+        b->files[b->n++] = (batch_file){ .path = path,
+                                         .base_len = b->enc ? len : len - slen };
+    }
+    closedir(d);
+    return true;
+}
+
+// Orders files by path without suffix, so that a shared state sees them in
+// the same order on encryption and decryption.
+int compare_files(const void* in0, const void* in1)
+{
+    const batch_file* f0 = (const batch_file*)in0;
+    const batch_file* f1 = (const batch_file*)in1;
+    size_t len = f0->base_len < f1->base_len ? f0->base_len : f1->base_len;
+    int c = memcmp(f0->path, f1->path, len);
+    if (c != 0)
+        return c;
+    return f0->base_len < f1->base_len ? -1 : f0->base_len > f1->base_len;
+}
+
+// Encrypts or decrypts a single file of a batch through `s`, with buffers
+// `in` (one chunk) and `out` (one chunk plus 32 bytes).
+int batch_file_run(batch* b, const char* in_path, scb_stream* s, uint8_t* in,
+                   uint8_t* out)
+{
+    char* out_path;
+    if (b->enc)
+        out_path = encrypted_path(in_path, b->max_count, b->max_hash);
+    else
+    {
+        out_path = (char*)malloc((strlen(in_path) + 5) * sizeof(*in_path));
+        strcpy(out_path, in_path);
+        strcat(out_path, ".dec");
+    }
+    int in_fd, out_fd;
+    int ret = open_files(in_path, &in_fd, out_path, &out_fd);
+    if (ret != 0)
+    {
+        free(out_path);
+        return ret;
+    }
+
+    // As in encrypt_file and decrypt_file, except that the parameters of
+    // a header must be those of the batch.
+    uint8_t h[HEADER_LEN];
+    size_t h_len = 0;
+    bool ok = true;
+    if (b->enc && b->opts->header)
+    {
+        struct stat st;
+        fstat(in_fd, &st);
+        header_write(h, b->key, b->max_count, b->max_hash, st.st_size, 0);
+        ok = write_full(out_fd, h, HEADER_LEN);
+    }
+    else if (!b->enc)
+    {
+        size_t max_count = b->max_count;
+        size_t max_hash = b->max_hash;
+        size_t expected;
+        size_t chunked = 0;
+        ret = header_read(in_fd, in_path, b->key, &max_count, &max_hash,
+                          &expected, &chunked, h, &h_len);
+        if (ret == 0 && chunked != 0)
+        {
+            printf("File \"%s\" is chunked, which dec-dir does not " \
+                   "support.\n", in_path);
+            ret = -1;
+        }
+        if (ret != 0)
+        {
+            close(in_fd);
+            close(out_fd);
+            unlink(out_path);
+            free(out_path);
+            return ret;
+        }
+        scb_decrypt_update(s, h, h_len, out);
+    }
+
+    size_t len = h_len;
+    ssize_t n;
+    while ((n = read_full(in_fd, in, b->opts->chunk)) > 0)
+    {
+        len += n;
+        ok &= write_full(out_fd, out, b->enc ?
+                         scb_encrypt_update(s, in, n, out) :
+                         scb_decrypt_update(s, in, n, out));
+    }
+    ok &= write_full(out_fd, out, b->enc ? scb_encrypt_final(s, out) :
+                                           scb_decrypt_final(s, out));
+    ret = close_files(in_path, in_fd, out_path, out_fd, len, ok && n == 0);
+    free(out_path);
+    return ret;
+}
+
+// Worker of a batch, taking files until none are left. Each worker reuses
+// its buffers and (unless shared) its state, reset for every file (keeping
+// the size it grew to).
+void batch_run(size_t begin, size_t end, void* udata)
+{
+    batch* b = (batch*)udata;
+    const file_opts* opts = b->opts;
+    uint8_t* in = (uint8_t*)malloc(opts->chunk);
+    uint8_t* out = (uint8_t*)malloc(opts->chunk + 32);
+    scb_state own = NULL;
+    scb_state* mem = opts->shared ? &b->shared : &own;
+
+    for (size_t i; (i = atomic_fetch_add(&b->next, 1)) < b->n; )
+    {
+        if (own != NULL)
+            scb_state_reset(own);
+
+        scb_stream s;
+        if (b->enc)
+            scb_encrypt_init(&s, b->key, b->max_count, b->max_hash, mem);
+        else
+            scb_decrypt_init_copy(&s, b->key, b->max_count, b->max_hash, mem);
+        s.sort = opts->engine == ENGINE_SORT;
+        s.threads = opts->shared ? opts->threads : 1;
+        if (batch_file_run(b, b->files[i].path, &s, in, out) != 0)
+            atomic_fetch_add(&b->failed, 1);
+    }
+
+    scb_state_free(own);
+    free(in);
+    free(out);
+}
+
+int process_dir(size_t max_count, size_t max_hash, char* key_path,
+                char* dir_path, bool enc, const file_opts* opts)
+{
+    if (max_count + max_hash > 16)
+    {
+        printf("Need max_count + max_hash <= 16.\n");
+        return -2;
+    }
+
+    uint8_t key[16];
+    int ret = read_key(key_path, key);
+    if (ret != 0)
+        return ret;
+
+    batch b = { .key = key, .max_count = max_count, .max_hash = max_hash,
+                .enc = enc, .opts = opts };
+    atomic_init(&b.next, 0);
+    atomic_init(&b.failed, 0);
+    char* suffix = encrypted_path("", max_count, max_hash);
+    bool found = batch_collect(&b, dir_path, suffix);
+    free(suffix);
+    if (!found)
+    {
+        printf("Directory \"%s\" not found.\n", dir_path);
+        return -5;
+    }
+    qsort(b.files, b.n, sizeof(*b.files), compare_files);
+
+    // A shared state depends on the order of the files, so they are then
+    // processed one at a time, and the threads work within each file.
+    if (opts->verbose)
+        printf(enc ? "SCB encrypting %zu files ... " :
+                     "SCB decrypting %zu files ... ", b.n);
+    fflush(stdout);
+    size_t workers = opts->shared ? 1 : parallel_threads(opts->threads);
+    parallel_for(workers, workers, batch_run, &b);
+    size_t failed = atomic_load(&b.failed);
+    if (opts->verbose)
+        printf("Done (%zu failed).\n", failed);
+
+    for (size_t i = 0; i < b.n; ++i)
+        free(b.files[i].path);
+    free(b.files);
+    scb_state_free(b.shared);
+
+    return failed == 0 ? 0 : -6;
+}
+
+// Parses a size in bytes with an optional K, M or G suffix.
+bool parse_size(const char* str, size_t* size)
+{
+    char unit = 0;
+    int n = sscanf(str, "%zu%c", size, &unit);
+    size_t shift = unit == 'K' ? 10 : unit == 'M' ? 20 : unit == 'G' ? 30 : 0;
+    if (n < 1 || (n == 2 && shift == 0))
+        return false;
+    *size <<= shift;
+    return true;
+}
+
+static void usage(void)
+{
+    printf("Usage: scb_file enc[+]|dec|enc-dir|dec-dir|dec-range|enc-append|" \
+           "enc-update|plan max_count max_hash key_path input_file|input_dir [verbose] " \
+           "[engine=hash|sort|ext|pipe] [threads=N] [mem=SIZE] [chunk=SIZE] " \
+           "[mmap] [inplace] [state=file|shared] [index] [header] " \
+           "[offset=SIZE] [length=SIZE] [checkpoint=SIZE] [table=DIR] " \
+           "[samples=N] [chunked=SIZE]\n");
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc == 6 || argc == 7)
+    if (argc >= 6)
     {
         size_t max_count; // SEC (sigma / 8)
         size_t max_hash; // COR (tau / 8)
+        // Decryption may take them from the header of the file instead.
+        size_t min = !strcmp(argv[1], "dec") ||
+                     !strcmp(argv[1], "dec-range") ? 0 : 1;
         int ret = sscanf(argv[2], "%zu", &max_count);
-        if (ret != 1 || max_count < 1 || max_count > 16)
+        if (ret != 1 || max_count < min || max_count > 16)
         {
-            printf("max_count and max_hash must be values between 1 and 16.\n");
+            printf("max_count and max_hash must be values between %zu and " \
+                   "16.\n", min);
             return -1;
         }
         ret = sscanf(argv[3], "%zu", &max_hash);
-        if (ret != 1 || max_hash < 1 || max_hash > 16)
+        if (ret != 1 || max_hash < min || max_hash > 16)
         {
-            printf("max_count and max_hash must be values between 1 and 16.\n");
+            printf("max_count and max_hash must be values between %zu and " \
+                   "16.\n", min);
             return -1;
         }
         
-        bool verbose = argc == 7 && !strncmp(argv[6], "verbose", 7);
+        file_opts opts = { .verbose = false, .engine = ENGINE_HASH,
+                           .threads = 1, .budget = (size_t)256 << 20,
+                           .chunk = (size_t)4 << 20, .length = SIZE_MAX,
+                           .samples = (size_t)1 << 16 };
+        for (int i = 6; i < argc; ++i)
+        {
+            if (!strncmp(argv[i], "verbose", 7))
+                opts.verbose = true;
+            else if (!strcmp(argv[i], "mmap"))
+                opts.mmap = true;
+            else if (!strcmp(argv[i], "inplace"))
+                opts.in_place = true;
+            else if (!strncmp(argv[i], "state=", 6))
+            {
+                if (!strcmp(argv[i] + 6, "file"))
+                    opts.shared = false;
+                else if (!strcmp(argv[i] + 6, "shared"))
+                    opts.shared = true;
+                else
+                {
+                    printf("state must be one of file or shared.\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "engine=", 7))
+            {
+                if (!strcmp(argv[i] + 7, "hash"))
+                    opts.engine = ENGINE_HASH;
+                else if (!strcmp(argv[i] + 7, "sort"))
+                    opts.engine = ENGINE_SORT;
+                else if (!strcmp(argv[i] + 7, "ext"))
+                    opts.engine = ENGINE_EXT;
+                else if (!strcmp(argv[i] + 7, "pipe"))
+                    opts.engine = ENGINE_PIPE;
+                else
+                {
+                    printf("engine must be one of hash, sort, ext or pipe.\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "mem=", 4))
+            {
+                if (parse_size(argv[i] + 4, &opts.budget))
+                    opts.dec_budget = opts.budget;
+                else
+                {
+                    printf("mem must be a size in bytes (with optional " \
+                           "K, M or G suffix).\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "chunk=", 6))
+            {
+                if (!parse_size(argv[i] + 6, &opts.chunk) ||
+                    opts.chunk < 16 || opts.chunk % 16 != 0)
+                {
+                    printf("chunk must be a positive multiple of 16 bytes " \
+                           "(with optional K, M or G suffix).\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "chunked=", 8))
+            {
+                if (!parse_size(argv[i] + 8, &opts.chunked) ||
+                    opts.chunked < 16 || opts.chunked % 16 != 0 ||
+                    opts.chunked / 16 > UINT32_MAX)
+                {
+                    printf("chunked must be a positive multiple of 16 " \
+                           "bytes up to 64G (with optional K, M or G " \
+                           "suffix).\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "table=", 6))
+                opts.table = argv[i] + 6;
+            else if (!strcmp(argv[i], "index"))
+                opts.index = true;
+            else if (!strcmp(argv[i], "header"))
+                opts.header = true;
+            else if (!strncmp(argv[i], "checkpoint=", 11))
+            {
+                if (!parse_size(argv[i] + 11, &opts.checkpoint) ||
+                    opts.checkpoint < 16 || opts.checkpoint % 16 != 0)
+                {
+                    printf("checkpoint must be a positive multiple of 16 " \
+                           "bytes (with optional K, M or G suffix).\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "offset=", 7))
+            {
+                if (!parse_size(argv[i] + 7, &opts.offset))
+                {
+                    printf("offset must be a size in bytes (with optional " \
+                           "K, M or G suffix).\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "length=", 7))
+            {
+                if (!parse_size(argv[i] + 7, &opts.length))
+                {
+                    printf("length must be a size in bytes (with optional " \
+                           "K, M or G suffix).\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "samples=", 8))
+            {
+                if (!parse_size(argv[i] + 8, &opts.samples) ||
+                    opts.samples == 0)
+                {
+                    printf("samples must be a positive number (with " \
+                           "optional K, M or G suffix).\n");
+                    return -1;
+                }
+            }
+            else if (!strncmp(argv[i], "threads=", 8))
+            {
+                if (sscanf(argv[i] + 8, "%zu", &opts.threads) != 1)
+                {
+                    printf("threads must be a non-negative integer.\n");
+                    return -1;
+                }
+            }
+            else
+            {
+                usage();
+                return -1;
+            }
+        }
+
+        if (opts.engine == ENGINE_PIPE &&
+            (strcmp(argv[1], "enc") || opts.mmap || opts.in_place ||
+             opts.index || opts.checkpoint != 0 || opts.chunked != 0))
+        {
+            printf("engine=pipe is only supported by enc, and not with " \
+                   "mmap, inplace, index, checkpoint or chunked.\n");
+            return -1;
+        }
+        if ((opts.mmap || opts.in_place) && opts.engine == ENGINE_EXT)
+        {
+            printf("mmap and inplace are not supported with engine=ext.\n");
+            return -1;
+        }
+        if (opts.index && (opts.engine == ENGINE_EXT || opts.in_place ||
+                           !strcmp(argv[5], "-") || strncmp(argv[1], "enc", 3) ||
+                           !strcmp(argv[1], "enc-dir") || argv[1][3] == '+'))
+        {
+            printf("index is only supported by enc, and not with " \
+                   "engine=ext, inplace or -.\n");
+            return -1;
+        }
+        if (!strcmp(argv[1], "dec") && opts.dec_budget != 0 &&
+            (opts.mmap || opts.in_place))
+        {
+            printf("mem is not supported by dec with mmap or inplace.\n");
+            return -1;
+        }
+        if (opts.table != NULL && (strcmp(argv[1], "enc") ||
+                                   opts.engine == ENGINE_EXT ||
+                                   opts.checkpoint != 0))
+        {
+            printf("table is only supported by enc, and not with " \
+                   "engine=ext or checkpoint.\n");
+            return -1;
+        }
+        if (opts.chunked != 0 && ((strcmp(argv[1], "enc") &&
+                                   strcmp(argv[1], "dec") &&
+                                   strcmp(argv[1], "dec-range")) ||
+                                  opts.engine == ENGINE_EXT || opts.index ||
+                                  opts.checkpoint != 0 || opts.table != NULL ||
+                                  opts.dec_budget != 0))
+        {
+            printf("chunked is only supported by enc, dec and dec-range, " \
+                   "and not with engine=ext, index, checkpoint, table or " \
+                   "mem.\n");
+            return -1;
+        }
+        if (!strcmp(argv[1], "enc-update") ||
+            (!strcmp(argv[1], "enc") && opts.checkpoint != 0))
+        {
+            if (opts.engine == ENGINE_EXT || opts.mmap || opts.in_place ||
+                opts.index || opts.header || !strcmp(argv[5], "-"))
+            {
+                printf("checkpoint and enc-update are not supported with " \
+                       "engine=ext, mmap, inplace, index, header or -.\n");
+                return -1;
+            }
+            return encrypt_file_update(max_count, max_hash, argv[4], argv[5],
+                                       argv[1][3] == '-', &opts);
+        }
+        if (!strcmp(argv[1], "enc-append"))
+        {
+            if (opts.engine == ENGINE_EXT || opts.mmap || opts.in_place ||
+                opts.index || opts.header || !strcmp(argv[5], "-"))
+            {
+                printf("enc-append is not supported with engine=ext, mmap, " \
+                       "inplace, index, header or -.\n");
+                return -1;
+            }
+            return encrypt_file_append(max_count, max_hash, argv[4], argv[5],
+                                       &opts);
+        }
+        if (opts.header && (opts.engine == ENGINE_EXT || opts.in_place ||
+                            !strcmp(argv[5], "-") ||
+                            strncmp(argv[1], "enc", 3)))
+        {
+            printf("header is only supported by enc, enc+ and enc-dir, and " \
+                   "not with engine=ext, inplace or -.\n");
+            return -1;
+        }
+        if (!strcmp(argv[1], "plan"))
+        {
+            if (!strcmp(argv[5], "-"))
+            {
+                printf("plan is not supported with -.\n");
+                return -1;
+            }
+            return plan_file(max_count, max_hash, argv[4], argv[5], &opts);
+        }
+        if (!strcmp(argv[1], "dec-range"))
+        {
+            binary_mode(STDOUT_FILENO);
+            stdout_fd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            return decrypt_range(max_count, max_hash, argv[4], argv[5], &opts);
+        }
+        if (!strcmp(argv[1], "enc-dir") || !strcmp(argv[1], "dec-dir"))
+        {
+            if (opts.engine == ENGINE_EXT || opts.mmap || opts.in_place)
+            {
+                printf("enc-dir and dec-dir are not supported with " \
+                       "engine=ext, mmap or inplace.\n");
+                return -1;
+            }
+            return process_dir(max_count, max_hash, argv[4], argv[5],
+                               argv[1][0] == 'e', &opts);
+        }
+        if (!strcmp(argv[5], "-"))
+        {
+            if (opts.engine == ENGINE_EXT || opts.mmap || opts.in_place)
+            {
+                printf("- is not supported with engine=ext, mmap or " \
+                       "inplace.\n");
+                return -1;
+            }
+            binary_mode(STDOUT_FILENO);
+            stdout_fd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        }
         if (!strncmp(argv[1], "enc+", 4))
-            return encrypt_file_check(max_count, max_hash, argv[4], argv[5]);
+        {
+            if (opts.engine == ENGINE_EXT || opts.mmap || opts.in_place)
+            {
+                printf("enc+ is not supported with engine=ext, mmap or " \
+                       "inplace.\n");
+                return -1;
+            }
+            opts.verbose = true;
+            return encrypt_file_check(max_count, max_hash, argv[4], argv[5],
+                                      &opts);
+        }
         else if (!strncmp(argv[1], "enc", 3))
-            return encrypt_file(max_count, max_hash, argv[4], argv[5], verbose);
+            return encrypt_file(max_count, max_hash, argv[4], argv[5], &opts);
         else if (!strncmp(argv[1], "dec", 3))
-            return decrypt_file(max_count, max_hash, argv[4], argv[5], verbose);
+            return decrypt_file(max_count, max_hash, argv[4], argv[5], &opts);
     }
     
-    printf("Usage: scb_file enc[+]|dec max_count max_hash key_path " \
-           "input_file [verbose]\n");
+    usage();
     
     return 0;
 }
\ No newline at end of file
@@ -87,6 +87,7 @@ int encrypt_image(size_t max_count, size_t max_hash, char* key_path,
     strcat(ptx_path, suffix);
     stbi_write_png(ptx_path, width, height, bpp, ctx, bpp * width);
 
+    scb_state_free(mem);
     stbi_image_free(ptx);
     free(ctx);
     free(suffix);
@@ -165,6 +166,8 @@ int encrypt_image_check(size_t max_count, size_t max_hash, char* key_path,
     strcat(ptx_path, suffix);
     stbi_write_png(ptx_path, width, height, bpp, ctx, bpp * width);
 
+    scb_state_free(mem_enc);
+    scb_state_free(mem_dec);
     stbi_image_free(ptx);
     free(ctx);
     free(dec);
@@ -230,6 +233,7 @@ int decrypt_image(size_t max_count, size_t max_hash, char* key_path,
     strcat(ctx_path, suffix);
     stbi_write_png(ctx_path, width, height, bpp, dec, bpp * width);
 
+    scb_state_free(mem);
     stbi_image_free(ctx);
     free(dec);
     free(suffix);
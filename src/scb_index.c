@@ -0,0 +1,180 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Random-access decryption. A repeat block refers to the hash of a first
+// occurrence, which during sequential decryption is the latest block stored
+// under that hash. Since encryption stores every hash only once, knowing the
+// position of the first occurrence of each hash is enough to resolve any
+// repeat block: it refers to that block if it comes earlier, and to nothing
+// otherwise. The state at any position thus follows from the index alone.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include <openssl/aes.h>
+
+#include "scb.h"
+#include "scb_core.h"
+
+void scb_index_init(scb_index* idx)
+{
+    *idx = (scb_index){ .entries = NULL, .n = 0, .cap = 0, .blocks = 0 };
+}
+
+bool scb_index_update(scb_index* idx, const uint8_t* key, const uint8_t* ptx,
+                      const uint8_t* ctx, const size_t len,
+                      const size_t max_hash, const bool last)
+{
+    AES_KEY aes_key;
+    AES_set_encrypt_key(key, 128, &aes_key);
+
+    // With a partial last block, the ciphertext of the last full block is
+    // not stored as such. Its first occurrence cannot be referred to, since
+    // only the stolen block comes after it, and is left out.
+    size_t l = ceil(len / 16.);
+    size_t n = !last ? len / 16 : len % 16 == 0 ? l : l - 2;
+    for (size_t i = 0; i < n; ++i)
+    {
+        // First occurrences are exactly the blocks encrypted as they are.
+        uint8_t block[16];
+        AES_encrypt(ptx + i * 16, block, &aes_key);
+        if (memcmp(block, ctx + i * 16, 16 * sizeof(uint8_t)))
+            continue;
+
+        if (idx->n == idx->cap)
+        {
+            size_t cap = idx->cap == 0 ? 1024 : idx->cap * 2;
+            size_t* entries = (size_t*)realloc(idx->entries,
+                                               cap * 2 * sizeof(size_t));
+            if (entries == NULL)
+                return false;
+            idx->entries = entries;
+            idx->cap = cap;
+        }
+        uint8_t hash_[16];
+        block_hash(ptx + i * 16, hash_);
+        idx->entries[idx->n * 2] = bytes_to_int(hash_, max_hash);
+        idx->entries[idx->n * 2 + 1] = idx->blocks + i;
+        ++idx->n;
+    }
+    idx->blocks += l;
+    return true;
+}
+
+bool scb_index_final(scb_index* idx)
+{
+    return sort_pairs((hash_to_index*)idx->entries, idx->n);
+}
+
+void scb_index_free(scb_index* idx)
+{
+    free(idx->entries);
+    scb_index_init(idx);
+}
+
+// Returns the block of the first occurrence of `hash` if it comes before
+// block `before`, or -1.
+static size_t index_lookup(const scb_index* idx, const size_t hash,
+                           const size_t before)
+{
+    const hash_to_index* pairs = (const hash_to_index*)idx->entries;
+    size_t lo = 0;
+    size_t hi = idx->n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pairs[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < idx->n && pairs[lo].hash == hash && pairs[lo].index < before)
+        return pairs[lo].index;
+    return (size_t)-1;
+}
+
+// Decrypts the ciphertext block `in` found at block `pos`, returning whether
+// it was stored as a first occurrence.
+static bool range_block(const AES_KEY* aes_key, const uint8_t* key,
+                        const uint8_t* ctx, const uint8_t* in,
+                        const size_t pos, const size_t max_count,
+                        const size_t max_hash, const scb_index* idx,
+                        uint8_t* out)
+{
+    AES_decrypt(in, out, aes_key);
+
+    size_t hash;
+    if (!block_classify(key, out, max_count, max_hash, &hash))
+        return true;
+    size_t first = index_lookup(idx, hash, pos);
+    if (first == (size_t)-1)
+        return true;
+    AES_decrypt(ctx + first * 16, out, aes_key);
+    return false;
+}
+
+void scb_decrypt_range(const uint8_t* key, const uint8_t* ctx,
+                       const size_t len, const size_t max_count,
+                       const size_t max_hash, const scb_index* idx,
+                       const size_t offset, const size_t count, uint8_t* ptx)
+{
+    if (count == 0)
+        return;
+
+    AES_KEY aes_key;
+    AES_set_decrypt_key(key, 128, &aes_key);
+
+    size_t l = ceil(len / 16.);
+    size_t m = len % 16;
+    size_t end = (offset + count - 1) / 16 + 1;
+    size_t full = m == 0 ? l : l - 2; // Blocks without ciphertext stealing
+    for (size_t i = offset / 16; i < end && i < full; ++i)
+    {
+        uint8_t block[16];
+        range_block(&aes_key, key, ctx, ctx + i * 16, i, max_count, max_hash,
+                    idx, block);
+        size_t from = i * 16 < offset ? offset - i * 16 : 0;
+        size_t to = (i + 1) * 16 > offset + count ? offset + count - i * 16 : 16;
+        memcpy(ptx + i * 16 + from - offset, block + from,
+               (to - from) * sizeof(uint8_t));
+    }
+    if (end <= full)
+        return;
+
+    // As in scb_decrypt_last, the stolen block comes first, and the last
+    // full block may refer to it (in which case it is decoded onto itself).
+    uint8_t tail[32];
+    bool set = range_block(&aes_key, key, ctx, ctx + (l - 2) * 16, l - 2,
+                           max_count, max_hash, idx, tail);
+    size_t stolen = 0;
+    if (set)
+    {
+        uint8_t hash_[16];
+        block_hash(tail, hash_);
+        stolen = bytes_to_int(hash_, max_hash);
+    }
+    memcpy(tail + 16, tail, m * sizeof(uint8_t));
+
+    uint8_t block[16];
+    memcpy(block, ctx + (l - 1) * 16, m * sizeof(uint8_t));
+    memcpy(block + m, tail + m, (16 - m) * sizeof(uint8_t));
+    uint8_t dec[16];
+    size_t hash;
+    AES_decrypt(block, dec, &aes_key);
+    if (set && block_classify(key, dec, max_count, max_hash, &hash) &&
+        hash == stolen)
+        memcpy(tail, dec, 16 * sizeof(uint8_t));
+    else
+        range_block(&aes_key, key, ctx, block, l - 2, max_count, max_hash,
+                    idx, tail);
+
+    size_t from = offset > (l - 2) * 16 ? offset - (l - 2) * 16 : 0;
+    size_t to = offset + count - (l - 2) * 16;
+    memcpy(ptx + (l - 2) * 16 + from - offset, tail + from,
+           (to - from) * sizeof(uint8_t));
+}
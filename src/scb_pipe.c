@@ -0,0 +1,364 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Pipelined encryption. A reader thread fills buffers, which then go
+// through hashing, counting, AES and writing, each stage on a thread of its
+// own (hashing and AES spreading the blocks of a buffer over the pool).
+// Counting is the only stage that needs the blocks in order, and the only
+// one that touches the state. Buffers pass from stage to stage through
+// bounded single-producer single-consumer rings, and back to the reader once
+// written, so that I/O and computing overlap and the throughput is that of
+// the slowest stage.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+
+#include <openssl/aes.h>
+
+#include "compat.h"
+#include "hashmap.h"
+#include "parallel.h"
+#include "scb.h"
+#include "scb_core.h"
+
+#define PIPE_SLOTS 6      // Buffers in flight
+#define PIPE_RING 8       // Capacity of a ring, a power of two
+#define PIPE_ALIGN 4096   // Alignment of the buffers
+#define PIPE_END SIZE_MAX // Passed down the rings after the last buffer
+
+// Ring of buffer numbers. Pushing and popping are lock-free, and only wait
+// (on `cond`) when the ring is full or empty.
+typedef struct ring
+{
+    size_t slots[PIPE_RING];
+    atomic_size_t head; // Next to pop
+    atomic_size_t tail; // Next to push
+    atomic_size_t waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ring;
+
+static void ring_init(ring* r)
+{
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->waiting, 0);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+}
+
+static void ring_destroy(ring* r)
+{
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+}
+
+// Waits until the ring no longer has `n` elements. The waiting thread is
+// counted before checking again, and the other side checks for waiting
+// threads after moving its index, so that one of them sees the other (all
+// accesses being sequentially consistent).
+static void ring_wait(ring* r, const size_t n)
+{
+    pthread_mutex_lock(&r->lock);
+    atomic_fetch_add(&r->waiting, 1);
+    while (atomic_load(&r->tail) - atomic_load(&r->head) == n)
+        pthread_cond_wait(&r->cond, &r->lock);
+    atomic_fetch_sub(&r->waiting, 1);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_wake(ring* r)
+{
+    if (atomic_load(&r->waiting) == 0)
+        return;
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_push(ring* r, const size_t slot)
+{
+    size_t tail = atomic_load(&r->tail);
+    if (tail - atomic_load(&r->head) == PIPE_RING)
+        ring_wait(r, PIPE_RING);
+    r->slots[tail % PIPE_RING] = slot;
+    atomic_store(&r->tail, tail + 1);
+    ring_wake(r);
+}
+
+static size_t ring_pop(ring* r)
+{
+    size_t head = atomic_load(&r->head);
+    if (atomic_load(&r->tail) == head)
+        ring_wait(r, 0);
+    size_t slot = r->slots[head % PIPE_RING];
+    atomic_store(&r->head, head + 1);
+    ring_wake(r);
+    return slot;
+}
+
+typedef struct slot
+{
+    uint8_t* in;  // Bytes held back from the previous buffer, then new ones
+    uint8_t* out;
+    size_t len;   // Bytes of whole blocks to encrypt
+} slot;
+
+typedef struct pipeline pipeline;
+
+typedef struct stage
+{
+    pipeline* pipe;
+    ring* in;
+    ring* out;
+    void (*run)(pipeline* p, slot* s);
+    pthread_t tid;
+} stage;
+
+struct pipeline
+{
+    AES_KEY aes_key;
+    const uint8_t* key;
+    size_t max_count;
+    size_t max_hash;
+    size_t chunk;
+    size_t threads;
+    int ptx_fd;
+    struct hashmap* mem;
+    slot slots[PIPE_SLOTS];
+    ring free;       // Buffers to read into
+    ring rings[4];   // Buffers to hash, count, encode and write
+    uint8_t tail[32]; // The end of the message, left to scb_encrypt
+    size_t tail_len;
+    size_t len;
+    atomic_int error; // errno of the first failure, which stops the reader
+};
+
+// Work of a stage on the blocks of one buffer, over the pool.
+typedef struct pipe_job
+{
+    pipeline* pipe;
+    slot* slot;
+} pipe_job;
+
+static void pipe_hash(size_t begin, size_t end, void* udata)
+{
+    pipe_job* job = (pipe_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+        block_hash(job->slot->in + i * 16, job->slot->out + i * 16);
+}
+
+static void pipe_encode(size_t begin, size_t end, void* udata)
+{
+    pipe_job* job = (pipe_job*)udata;
+    for (size_t i = begin; i < end; ++i)
+        AES_encrypt(job->slot->out + i * 16, job->slot->out + i * 16,
+                    &job->pipe->aes_key);
+}
+
+static void stage_hash(pipeline* p, slot* s)
+{
+    pipe_job job = { .pipe = p, .slot = s };
+    parallel_for(p->threads, s->len / 16, pipe_hash, &job);
+}
+
+// As in scb_block_encrypt, with the hash of each block in its output.
+static void stage_count(pipeline* p, slot* s)
+{
+    for (size_t i = 0; i < s->len / 16; ++i)
+    {
+        uint8_t* block = s->out + i * 16;
+        size_t hash = bytes_to_int(block, p->max_hash);
+        hash_to_count* h2c =
+            hashmap_get(p->mem, &(hash_to_count){ .hash = hash });
+        if (h2c == NULL)
+        {
+            memcpy(block, s->in + i * 16, 16 * sizeof(uint8_t));
+            hashmap_set(p->mem, &(hash_to_count){ .hash = hash, .count = 0 });
+        }
+        else
+        {
+            size_t count = h2c->count;
+            block_pad(p->key, block, count, p->max_count, p->max_hash, block);
+            hashmap_set(p->mem, &(hash_to_count){ .hash = hash,
+                                                  .count = count + 1 });
+        }
+    }
+}
+
+static void stage_encode(pipeline* p, slot* s)
+{
+    pipe_job job = { .pipe = p, .slot = s };
+    parallel_for(p->threads, s->len / 16, pipe_encode, &job);
+}
+
+static void* stage_run(void* arg)
+{
+    stage* st = (stage*)arg;
+    size_t i;
+    while ((i = ring_pop(st->in)) != PIPE_END)
+    {
+        st->run(st->pipe, &st->pipe->slots[i]);
+        ring_push(st->out, i);
+    }
+    ring_push(st->out, PIPE_END);
+    return NULL;
+}
+
+static void pipe_fail(pipeline* p, const int error)
+{
+    int none = 0;
+    atomic_compare_exchange_strong(&p->error, &none, error);
+}
+
+static ssize_t read_full(const int fd, uint8_t* buf, const size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+static bool write_full(const int fd, const uint8_t* buf, const size_t len)
+{
+    for (size_t done = 0; done < len; )
+    {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Reads whole buffers, passing on all but the last 17 to 32 bytes read so
+// far (as a stream does), which start the next buffer.
+static void* stage_read(void* arg)
+{
+    pipeline* p = (pipeline*)arg;
+    size_t i = ring_pop(&p->free);
+    size_t held = 0;
+    ssize_t n = 0;
+    while (atomic_load(&p->error) == 0 &&
+           (n = read_full(p->ptx_fd, p->slots[i].in + held, p->chunk)) > 0)
+    {
+        p->len += n;
+        held += n;
+        if (held <= 32)
+            continue;
+
+        slot* s = &p->slots[i];
+        s->len = (held - 17) / 16 * 16;
+        held -= s->len;
+        i = ring_pop(&p->free);
+        memcpy(p->slots[i].in, s->in + s->len, held * sizeof(uint8_t));
+        ring_push(&p->rings[0], s - p->slots);
+    }
+    if (n < 0)
+        pipe_fail(p, errno);
+    memcpy(p->tail, p->slots[i].in, held * sizeof(uint8_t));
+    p->tail_len = held;
+    ring_push(&p->rings[0], PIPE_END);
+    return NULL;
+}
+
+int scb_encrypt_pipeline(const uint8_t* key, const int ptx_fd,
+                         const int ctx_fd, const size_t max_count,
+                         const size_t max_hash, const size_t chunk,
+                         scb_state* mem, const size_t threads, size_t* len)
+{
+    if (*mem == NULL)
+        *mem = hashmap_new(sizeof(hash_to_count), 0, 0, 0, hash_int,
+                           compare_int, NULL, NULL);
+    pipeline* p = (pipeline*)malloc(sizeof(*p));
+    *p = (pipeline){ .key = key, .max_count = max_count,
+                     .max_hash = max_hash, .chunk = chunk,
+                     .threads = threads, .ptx_fd = ptx_fd, .mem = *mem };
+    AES_set_encrypt_key(key, 128, &p->aes_key);
+    ring_init(&p->free);
+    for (size_t i = 0; i < 4; ++i)
+        ring_init(&p->rings[i]);
+    bool ok = true;
+    for (size_t i = 0; i < PIPE_SLOTS; ++i)
+    {
+        void* in = NULL;
+        void* out = NULL;
+        ok &= !posix_memalign(&in, PIPE_ALIGN, chunk + 32) &&
+              !posix_memalign(&out, PIPE_ALIGN, chunk + 32);
+        p->slots[i] = (slot){ .in = (uint8_t*)in, .out = (uint8_t*)out };
+        ring_push(&p->free, i);
+    }
+
+    // This thread writes, and returns the buffers to the reader. If not
+    // all stages start, it takes the buffers from the last one started
+    // instead, without writing them.
+    stage stages[3] = {
+        { .pipe = p, .in = &p->rings[0], .out = &p->rings[1],
+          .run = stage_hash },
+        { .pipe = p, .in = &p->rings[1], .out = &p->rings[2],
+          .run = stage_count },
+        { .pipe = p, .in = &p->rings[2], .out = &p->rings[3],
+          .run = stage_encode } };
+    pthread_t reader;
+    bool reading = ok && !pthread_create(&reader, NULL, stage_read, p);
+    size_t started = 0;
+    while (reading && started < 3 &&
+           !pthread_create(&stages[started].tid, NULL, stage_run,
+                           &stages[started]))
+        ++started;
+    if (reading && started < 3)
+        pipe_fail(p, EAGAIN);
+
+    size_t i;
+    while (reading && (i = ring_pop(&p->rings[started])) != PIPE_END)
+    {
+        if (atomic_load(&p->error) == 0 &&
+            !write_full(ctx_fd, p->slots[i].out, p->slots[i].len))
+            pipe_fail(p, errno);
+        ring_push(&p->free, i);
+    }
+    if (reading)
+        pthread_join(reader, NULL);
+    for (size_t j = 0; j < started; ++j)
+        pthread_join(stages[j].tid, NULL);
+
+    int error = ok && !reading ? EAGAIN : !ok ? ENOMEM :
+                atomic_load(&p->error);
+    if (error == 0 && p->tail_len >= 16)
+    {
+        scb_encrypt(key, p->tail, p->slots[0].out, p->tail_len, max_count,
+                    max_hash, mem);
+        if (!write_full(ctx_fd, p->slots[0].out, p->tail_len))
+            error = errno;
+    }
+    *len = p->len;
+
+    for (size_t j = 0; j < PIPE_SLOTS; ++j)
+    {
+        aligned_free(p->slots[j].in);
+        aligned_free(p->slots[j].out);
+    }
+    ring_destroy(&p->free);
+    for (size_t j = 0; j < 4; ++j)
+        ring_destroy(&p->rings[j]);
+    free(p);
+    errno = error != 0 ? error : errno;
+    return error == 0 ? 0 : -1;
+}
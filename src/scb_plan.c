@@ -0,0 +1,195 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Capacity planning. The state of both encryption and decryption has one
+// entry per distinct block hash, which is estimated from a sample of blocks
+// spread over the input, so that planning reads only as many pages as there
+// are samples, whatever the size of the input.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "compat.h"
+#include "parallel.h"
+#include "scb.h"
+#include "scb_core.h"
+
+typedef struct sample_job
+{
+    const uint8_t* ptx;
+    size_t blocks;
+    size_t samples;
+    uint8_t* sample;       // The sampled blocks, in order
+    hash_to_index* pairs;  // Their hashes (64 bits of them)
+    bool* follows;         // Whether they equal the block before them
+} sample_job;
+
+// Takes one block at a pseudo-random position of each of the `samples`
+// equal strides of the input, so that periodic data does not line up with
+// the samples. The position depends only on the stride.
+static void sample_run(size_t begin, size_t end, void* udata)
+{
+    sample_job* job = (sample_job*)udata;
+    for (size_t k = begin; k < end; ++k)
+    {
+        size_t lo = k * job->blocks / job->samples;
+        size_t hi = (k + 1) * job->blocks / job->samples;
+        uint64_t x = (k + 1) * 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        size_t i = lo + x % (hi - lo);
+
+        memcpy(job->sample + k * 16, job->ptx + i * 16, 16 * sizeof(uint8_t));
+        job->follows[k] = i > 0 && !memcmp(job->ptx + i * 16,
+                                           job->ptx + (i - 1) * 16,
+                                           16 * sizeof(uint8_t));
+        uint8_t hash_[16];
+        block_hash(job->sample + k * 16, hash_);
+        job->pairs[k] = (hash_to_index){ .hash = bytes_to_int(hash_, 8),
+                                         .index = k };
+    }
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void sample_free(sample_job* job, uint8_t* out)
+{
+    free(out);
+    free(job->sample);
+    free(job->pairs);
+    free(job->follows);
+}
+
+bool scb_estimate_input(const uint8_t* key, const uint8_t* ptx,
+                        const size_t len, const size_t max_count,
+                        const size_t max_hash, const size_t samples,
+                        const size_t threads, scb_estimate* est)
+{
+    *est = (scb_estimate){ .blocks = len / 16 };
+    size_t n = est->blocks;
+    size_t r = samples == 0 || samples > n ? n : samples;
+    est->sampled = r;
+    if (r == 0)
+        return true;
+
+    sample_job job = { .ptx = ptx, .blocks = n, .samples = r,
+                       .sample = (uint8_t*)malloc(r * 16),
+                       .pairs = (hash_to_index*)malloc(r * sizeof(*job.pairs)),
+                       .follows = (bool*)malloc(r * sizeof(bool)) };
+    uint8_t* out = (uint8_t*)malloc(r * 16);
+    if (job.sample == NULL || job.pairs == NULL || job.follows == NULL ||
+        out == NULL)
+    {
+        sample_free(&job, out);
+        return false;
+    }
+    parallel_for(threads, r, sample_run, &job);
+
+    // The most frequent block, over all samples.
+    if (!sort_pairs(job.pairs, r))
+    {
+        sample_free(&job, out);
+        return false;
+    }
+    size_t most = 0;
+    for (size_t i = 0, j; i < r; i = j)
+    {
+        for (j = i + 1; j < r && job.pairs[j].hash == job.pairs[i].hash; ++j)
+            ;
+        if (j - i > most)
+            most = j - i;
+    }
+    // A block seen once tells nothing of how often it repeats.
+    est->repeats = most < 2 ? 0 : (size_t)llround((double)most * n / r) - 1;
+
+    // Runs of equal blocks would only be seen by samples within them, so
+    // the estimate is of the blocks that differ from the one before them
+    // (unless no sample does), whose share the sample tells too.
+    size_t m = 0;
+    for (size_t i = 0; i < r; ++i)
+        if (!job.follows[job.pairs[i].index])
+            job.pairs[m++] = job.pairs[i];
+    if (m == 0)
+        m = r; // The pairs are untouched then
+    double heads = (double)n * m / r;
+
+    // Frequency profile of the sample: distinct blocks, those seen once and
+    // twice, and the sums the estimators need.
+    double q = m / heads;
+    double d = 0;
+    double f1 = 0;
+    double f2 = 0;
+    double squares = 0;
+    double unseen = 0;
+    double seen = 0;
+    for (size_t i = 0, j; i < m; i = j)
+    {
+        for (j = i + 1; j < m && job.pairs[j].hash == job.pairs[i].hash; ++j)
+            ;
+        double f = j - i;
+        d += 1;
+        f1 += f == 1;
+        f2 += f == 2;
+        squares += f * f;
+        unseen += pow(1 - q, f);
+        seen += f * q * pow(1 - q, f - 1);
+    }
+
+    // As in the hybrid estimator of Haas et al. (VLDB 1995): if the sample
+    // frequencies look uniform (chi-squared test at 97.5%, with the
+    // Wilson-Hilferty approximation), the bias-corrected Chao1 estimator,
+    // which is good for uniform data, else the Shlosser estimator, which is
+    // good for skewed data. Both are exact once the whole input is sampled.
+    double mean = m / d;
+    double chi2 = (squares - 2 * mean * m + mean * mean * d) / mean;
+    double k = d - 1;
+    double z = 1 - 2 / (9 * k) + 1.96 * sqrt(2 / (9 * k));
+    double est_d = d > 1 && chi2 > k * z * z * z ?
+                   d + f1 * unseen / seen :
+                   d + f1 * (f1 - 1) / (2 * (f2 + 1));
+    if (est_d > heads - m + d)
+        est_d = heads - m + d;
+
+    // Distinct blocks may share a hash of max_hash bytes, and then share an
+    // entry (the expected number of hashes hit by est_d blocks).
+    if (max_hash < 8)
+    {
+        double h = pow(256, max_hash);
+        est_d = -h * expm1(-est_d / h);
+    }
+    est->distinct = est_d < d ? (size_t)d : (size_t)llround(est_d);
+
+    est->enc_bytes = state_table_bytes(est->distinct, sizeof(hash_to_count));
+    est->dec_bytes = state_table_bytes(est->distinct, sizeof(hash_to_copy));
+    est->budget_bytes = state_budget_bytes(est->distinct);
+    est->index_bytes = est->distinct * 2 * sizeof(size_t);
+
+    // Rates of the sample itself, with states as small as the sample.
+    scb_state mem = NULL;
+    double t0 = seconds();
+    scb_encrypt(key, job.sample, out, r * 16, max_count, max_hash, &mem);
+    double t1 = seconds();
+    scb_state_free(mem);
+    mem = NULL;
+    double t2 = seconds();
+    scb_decrypt_copy(key, out, job.sample, r * 16, max_count, max_hash, &mem);
+    double t3 = seconds();
+    scb_state_free(mem);
+    est->enc_rate = t1 > t0 ? r * 16 / (t1 - t0) : 0;
+    est->dec_rate = t3 > t2 ? r * 16 / (t3 - t2) : 0;
+
+    sample_free(&job, out);
+    return true;
+}
@@ -0,0 +1,806 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+
+#include "compat.h"
+#include "hashmap.h"
+#include "parallel.h"
+#include "scb.h"
+#include "scb_core.h"
+
+#define STATE_MAGIC "SCBSTATE"
+#define STATE_VERSION 3
+#define STATE_ORDER 0x01020304 // Tells the byte order of the file
+#define STATE_BATCH 4096 // Entries read or written at a time
+#define TABLE_MIN (1 << 16) // Smallest allocation kept in a file
+#define TABLE_HEAD 64 // Bytes in front of every table allocation
+
+// A saved state is this header followed by the buckets of the hash table
+// as they are in memory. The buckets hold no pointers, so the file can be
+// mapped and used as it is.
+typedef struct state_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    size_t elsize;
+    size_t bucketsz;
+    size_t nbuckets;
+    size_t count;
+    size_t reserved[2]; // Keeps the buckets aligned to 64 bytes
+} state_header;
+
+bool scb_state_save(scb_state mem, FILE* f)
+{
+    // Only the buckets are saved, which are those of counts for any state
+    // loaded back, and would miss what a snapshot keeps aside.
+    if (mem == NULL || hashmap_tag(mem) != STATE_COUNTS ||
+        hashmap_udata(mem) != NULL || hashmap_snapshotted(mem))
+        return false;
+
+    state_header h = { .version = STATE_VERSION, .order = STATE_ORDER,
+                       .elsize = sizeof(hash_to_count),
+                       .count = hashmap_count(mem) };
+    memcpy(h.magic, STATE_MAGIC, 8 * sizeof(char));
+    void* buckets = hashmap_buckets(mem, &h.nbuckets, &h.bucketsz);
+    return fwrite(&h, sizeof(h), 1, f) == 1 &&
+           fwrite(buckets, h.bucketsz, h.nbuckets, f) == h.nbuckets;
+}
+
+// The size of the buckets hashmap.c uses for elements of `elsize` bytes.
+static size_t bucket_size(const size_t elsize)
+{
+    return (sizeof(uint64_t) + elsize + sizeof(uintptr_t) - 1) /
+           sizeof(uintptr_t) * sizeof(uintptr_t);
+}
+
+// Checks a header read from a file of `len` bytes (from the header on).
+static bool state_check(const state_header* h, const size_t len)
+{
+    size_t bucketsz = bucket_size(h->elsize);
+    return !memcmp(h->magic, STATE_MAGIC, 8) &&
+           h->version == STATE_VERSION && h->order == STATE_ORDER &&
+           h->elsize == sizeof(hash_to_count) && h->bucketsz == bucketsz &&
+           h->nbuckets <= (len - sizeof(*h)) / h->bucketsz &&
+           h->count <= h->nbuckets;
+}
+
+bool scb_state_load(scb_state* mem, FILE* f)
+{
+    state_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || !state_check(&h, SIZE_MAX))
+        return false;
+
+    void* buckets = malloc(h.nbuckets * h.bucketsz);
+    if (buckets == NULL || fread(buckets, h.bucketsz, h.nbuckets, f) !=
+                           h.nbuckets)
+    {
+        free(buckets);
+        return false;
+    }
+    *mem = hashmap_new_with_buckets(h.elsize, buckets, h.nbuckets, h.count,
+                                    0, 0, hash_int, compare_int, NULL, NULL,
+                                    free, buckets);
+    if (*mem == NULL)
+        free(buckets);
+    return *mem != NULL;
+}
+
+typedef struct state_map
+{
+    void* addr;
+    size_t len;
+} state_map;
+
+static void state_unmap(void* arg)
+{
+    state_map* m = (state_map*)arg;
+    munmap(m->addr, m->len);
+    free(m);
+}
+
+bool scb_state_map(scb_state* mem, const char* path, const size_t offset)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    size_t len = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    if (len < offset + sizeof(state_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    // Private, so the state can be changed without touching the file.
+    uint8_t* addr = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return false;
+    const state_header* h = (const state_header*)(addr + offset);
+    if (!state_check(h, len - offset))
+    {
+        munmap(addr, len);
+        return false;
+    }
+
+    state_map* m = (state_map*)malloc(sizeof(*m));
+    *m = (state_map){ .addr = addr, .len = len };
+    *mem = hashmap_new_with_buckets(h->elsize, addr + offset + sizeof(*h),
+                                    h->nbuckets, h->count, 0, 0, hash_int,
+                                    compare_int, NULL, NULL, state_unmap, m);
+    if (*mem == NULL)
+        state_unmap(m);
+    return *mem != NULL;
+}
+
+bool scb_state_save_delta(scb_state mem, const uint8_t* ptx, const size_t len,
+                          const size_t max_hash, FILE* f)
+{
+    // Sorting the block hashes leaves one run per entry to write.
+    size_t l = len / 16;
+    hash_to_index* pairs = (hash_to_index*)malloc(l * sizeof(*pairs));
+    if (pairs == NULL && l > 0)
+        return false;
+    for (size_t i = 0; i < l; ++i)
+    {
+        uint8_t hash_[16];
+        block_hash(ptx + i * 16, hash_);
+        pairs[i] = (hash_to_index){ .hash = bytes_to_int(hash_, max_hash),
+                                    .index = i };
+    }
+    bool ok = sort_pairs(pairs, l);
+
+    // Every block has an entry, unless `ptx` was not encrypted with `mem`.
+    size_t n = 0;
+    for (size_t i = 0; ok && i < l; ++i)
+    {
+        if (i > 0 && pairs[i].hash == pairs[i - 1].hash)
+            continue;
+        hash_to_count* h2c = mem == NULL ? NULL : (hash_to_count*)hashmap_get(
+            mem, &(hash_to_count){ .hash = pairs[i].hash });
+        ok = h2c != NULL;
+        if (ok)
+            pairs[n++] = (hash_to_index){ .hash = pairs[i].hash,
+                                          .index = h2c->count };
+    }
+    ok = ok && fwrite(&n, sizeof(n), 1, f) == 1 &&
+         fwrite(pairs, sizeof(*pairs), n, f) == n;
+    free(pairs);
+    return ok;
+}
+
+bool scb_state_load_delta(scb_state* mem, FILE* f)
+{
+    if (*mem == NULL)
+        *mem = hashmap_new(sizeof(hash_to_count), 0, 0, 0, hash_int,
+                           compare_int, NULL, NULL);
+
+    size_t n;
+    if (fread(&n, sizeof(n), 1, f) != 1)
+        return false;
+    hash_to_count* batch = (hash_to_count*)malloc(STATE_BATCH *
+                                                  sizeof(*batch));
+    bool ok = true;
+    for (size_t done = 0; ok && done < n; )
+    {
+        size_t k = n - done < STATE_BATCH ? n - done : STATE_BATCH;
+        ok = fread(batch, sizeof(*batch), k, f) == k;
+        for (size_t i = 0; ok && i < k; ++i)
+            hashmap_set(*mem, &batch[i]);
+        done += k;
+    }
+    free(batch);
+    return ok;
+}
+
+// Tables kept in files. hashmap.c allocates through plain functions, so the
+// directory is shared by all such tables of the process, and can only change
+// once none of their allocations is left.
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static char table_dir[PATH_MAX];
+static atomic_size_t table_live = 0;
+
+typedef struct table_alloc
+{
+    size_t len; // Of the mapping, or 0 if allocated with calloc
+} table_alloc;
+
+// Allocates zeroed memory: small blocks (such as the map itself) on the
+// heap, bucket arrays in a mapping of a fresh sparse file, which is removed
+// at once and so goes away with the mapping. Untouched pages take neither
+// memory nor disk, and the page cache decides which of the others stay in
+// memory.
+static void* table_malloc(size_t size)
+{
+    if (size < TABLE_MIN)
+    {
+        uint8_t* p = (uint8_t*)calloc(1, TABLE_HEAD + size);
+        if (p == NULL)
+            return NULL;
+        ((table_alloc*)p)->len = 0;
+        atomic_fetch_add(&table_live, 1);
+        return p + TABLE_HEAD;
+    }
+
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/scb_table_XXXXXX", table_dir) >= PATH_MAX)
+        return NULL;
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return NULL;
+    unlink(path);
+    size_t len = TABLE_HEAD + size;
+    uint8_t* p = MAP_FAILED;
+    if (ftruncate(fd, len) == 0)
+        p = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    // Buckets are reached by hash, and a lookup probes a few neighbouring
+    // buckets, which mostly share a page: reading ahead would only evict
+    // pages that are still of use.
+    madvise(p, len, MADV_RANDOM);
+    ((table_alloc*)p)->len = len;
+    atomic_fetch_add(&table_live, 1);
+    return p + TABLE_HEAD;
+}
+
+static void* table_realloc(void* ptr, size_t size)
+{
+    // Not used by hashmap.c.
+    (void)ptr;
+    (void)size;
+    return NULL;
+}
+
+static void table_free(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+    uint8_t* p = (uint8_t*)ptr - TABLE_HEAD;
+    size_t len = ((table_alloc*)p)->len;
+    if (len == 0)
+        free(p);
+    else
+        munmap(p, len);
+    atomic_fetch_sub(&table_live, 1);
+}
+
+bool scb_state_new_file(scb_state* mem, const char* dir, const size_t entries)
+{
+    if (strlen(dir) >= PATH_MAX)
+        return false;
+    pthread_mutex_lock(&table_lock);
+    if (atomic_load(&table_live) != 0 && strcmp(table_dir, dir))
+    {
+        pthread_mutex_unlock(&table_lock);
+        return false;
+    }
+    strcpy(table_dir, dir);
+
+    // Sized so that `entries` fit without resizing, which would rewrite the
+    // whole table. The file being sparse, a generous size costs nothing.
+    *mem = hashmap_new_with_zeroed_allocator(table_malloc, table_realloc,
+                                             table_free, sizeof(hash_to_count),
+                                             entries / 3 * 4 + 16, 0, 0,
+                                             hash_int, compare_int, NULL,
+                                             NULL);
+    pthread_mutex_unlock(&table_lock);
+    return *mem != NULL;
+}
+
+// Element of a budgeted state: a hash_to_copy, and its slot in the list.
+typedef struct hash_to_slot
+{
+    size_t hash;
+    uint8_t block[16];
+    size_t slot;
+} hash_to_slot;
+
+// The entries of a budgeted state are kept in slots, linked from the most
+// to the least recently used. The hashes of evicted entries are kept too,
+// as long as there is room for them.
+struct state_budget
+{
+    void* buckets;     // Of the map, fixed in size
+    size_t cap;        // Entries that fit without the map growing
+    size_t n;
+    size_t* hashes;    // Per slot
+    size_t* prev;
+    size_t* next;
+    size_t head;       // Most recently used slot
+    size_t tail;       // Least recently used slot
+    struct hashmap* evicted;
+    size_t evicted_cap;
+    size_t evictions;
+    size_t unresolved;
+    bool exact;        // Whether all evicted hashes are known
+};
+
+#define NO_SLOT ((size_t)-1)
+
+static void budget_unlink(state_budget* b, const size_t slot)
+{
+    if (b->prev[slot] != NO_SLOT)
+        b->next[b->prev[slot]] = b->next[slot];
+    else
+        b->head = b->next[slot];
+    if (b->next[slot] != NO_SLOT)
+        b->prev[b->next[slot]] = b->prev[slot];
+    else
+        b->tail = b->prev[slot];
+}
+
+static void budget_push(state_budget* b, const size_t slot)
+{
+    b->prev[slot] = NO_SLOT;
+    b->next[slot] = b->head;
+    if (b->head != NO_SLOT)
+        b->prev[b->head] = slot;
+    else
+        b->tail = slot;
+    b->head = slot;
+}
+
+const uint8_t* budget_block(struct hashmap* mem, state_budget* b,
+                            const size_t hash)
+{
+    hash_to_slot* h2s = (hash_to_slot*)hashmap_get(
+        mem, &(hash_to_slot){ .hash = hash });
+    if (h2s == NULL)
+        return NULL;
+    budget_unlink(b, h2s->slot);
+    budget_push(b, h2s->slot);
+    return h2s->block;
+}
+
+void budget_store(struct hashmap* mem, state_budget* b, const size_t hash,
+                  const uint8_t* block)
+{
+    hash_to_slot h2s = { .hash = hash };
+    memcpy(h2s.block, block, 16 * sizeof(uint8_t));
+    hash_to_slot* old = (hash_to_slot*)hashmap_get(mem, &h2s);
+    if (old != NULL)
+    {
+        memcpy(old->block, block, 16 * sizeof(uint8_t));
+        budget_unlink(b, old->slot);
+        budget_push(b, old->slot);
+        return;
+    }
+
+    // Evicting before inserting keeps the map at its size (it is never
+    // resized, which would release the buckets).
+    if (b->n < b->cap)
+        h2s.slot = b->n++;
+    else
+    {
+        h2s.slot = b->tail;
+        budget_unlink(b, h2s.slot);
+        hashmap_delete(mem, &(hash_to_slot){ .hash = b->hashes[h2s.slot] });
+        if (hashmap_count(b->evicted) < b->evicted_cap)
+            hashmap_set(b->evicted, &b->hashes[h2s.slot]);
+        else
+            b->exact = false;
+        ++b->evictions;
+    }
+    b->hashes[h2s.slot] = hash;
+    budget_push(b, h2s.slot);
+    hashmap_set(mem, &h2s);
+    if (b->evictions > 0)
+        hashmap_delete(b->evicted, (void*)&hash);
+}
+
+bool budget_evicted(state_budget* b, const size_t hash)
+{
+    if (b->evictions == 0 || hashmap_get(b->evicted, &hash) == NULL)
+        return false;
+    ++b->unresolved;
+    return true;
+}
+
+static void budget_release(void* arg)
+{
+    state_budget* b = (state_budget*)arg;
+    free(b->buckets);
+    free(b->hashes);
+    free(b->prev);
+    free(b->next);
+    hashmap_free(b->evicted);
+    free(b);
+}
+
+// The largest power of two of at most `n`, or 0.
+static size_t floor_pow2(const size_t n)
+{
+    size_t p = 1;
+    while (p <= n / 2)
+        p *= 2;
+    return n == 0 ? 0 : p;
+}
+
+bool scb_state_new_budget(scb_state* mem, const size_t budget)
+{
+    // Three quarters of the budget for the entries (buckets and slots), the
+    // rest for the hashes of evicted entries (a size_t in a bucket of 16
+    // bytes each). Maps stay below three quarters full.
+    size_t bucketsz = bucket_size(sizeof(hash_to_slot));
+    size_t nbuckets = floor_pow2(budget / 4 * 3 /
+                                 (bucketsz + 3 * sizeof(size_t) * 3 / 4));
+    size_t nevicted = floor_pow2(budget / 4 / bucket_size(sizeof(size_t)));
+    if (nbuckets < 16 || nevicted < 16)
+        return false;
+
+    state_budget* b = (state_budget*)calloc(1, sizeof(*b));
+    b->cap = nbuckets * 3 / 4 - 1;
+    b->buckets = calloc(nbuckets, bucketsz);
+    b->hashes = (size_t*)malloc(b->cap * sizeof(size_t));
+    b->prev = (size_t*)malloc(b->cap * sizeof(size_t));
+    b->next = (size_t*)malloc(b->cap * sizeof(size_t));
+    b->head = NO_SLOT;
+    b->tail = NO_SLOT;
+    b->evicted = hashmap_new(sizeof(size_t), nevicted, 0, 0, hash_int,
+                             compare_int, NULL, NULL);
+    b->evicted_cap = nevicted * 3 / 4 - 1;
+    b->exact = true;
+    *mem = NULL;
+    if (b->buckets != NULL && b->hashes != NULL && b->prev != NULL &&
+        b->next != NULL && b->evicted != NULL)
+        *mem = hashmap_new_with_buckets(sizeof(hash_to_slot), b->buckets,
+                                        nbuckets, 0, 0, 0, hash_int,
+                                        compare_int, NULL, b, budget_release,
+                                        b);
+    if (*mem == NULL)
+        budget_release(b);
+    else
+        hashmap_set_tag(*mem, STATE_COPIES);
+    return *mem != NULL;
+}
+
+bool scb_state_budget_stats(scb_state mem, size_t* evictions,
+                            size_t* unresolved)
+{
+    state_budget* b = (state_budget*)hashmap_udata(mem);
+    *evictions = b != NULL ? b->evictions : 0;
+    *unresolved = b != NULL ? b->unresolved : 0;
+    return b == NULL || b->exact;
+}
+
+size_t state_table_bytes(const size_t entries, const size_t elsize)
+{
+    // Tables start with 16 buckets and double once 3/4 full, when the old
+    // array (half the new one) is still around.
+    size_t nbuckets = 16;
+    while (entries > nbuckets / 4 * 3)
+        nbuckets *= 2;
+    size_t peak = nbuckets > 16 ? nbuckets + nbuckets / 2 : nbuckets;
+    return peak * bucket_size(elsize);
+}
+
+size_t state_budget_bytes(const size_t entries)
+{
+    // Inverts the split of scb_state_new_budget.
+    size_t nbuckets = 16;
+    while (nbuckets / 4 * 3 - 1 < entries)
+        nbuckets *= 2;
+    size_t per = bucket_size(sizeof(hash_to_slot)) + 3 * sizeof(size_t) * 3 / 4;
+    return (nbuckets * per + 2) / 3 * 4 + 4;
+}
+
+void scb_state_free(scb_state mem)
+{
+    hashmap_free(mem);
+}
+
+void scb_state_reset(scb_state mem)
+{
+    state_budget* b = (state_budget*)hashmap_udata(mem);
+    if (b != NULL)
+    {
+        b->n = 0;
+        b->head = NO_SLOT;
+        b->tail = NO_SLOT;
+        hashmap_reset(b->evicted);
+        b->evictions = 0;
+        b->unresolved = 0;
+        b->exact = true;
+    }
+    hashmap_reset(mem);
+}
+
+// Copies a budgeted state, whose map does not own its buckets.
+static bool budget_clone(scb_state mem, state_budget* b, scb_state* copy)
+{
+    size_t nbuckets, bucketsz;
+    void* buckets = hashmap_buckets(mem, &nbuckets, &bucketsz);
+    state_budget* c = (state_budget*)malloc(sizeof(*c));
+    *c = *b;
+    c->buckets = malloc(nbuckets * bucketsz);
+    c->hashes = (size_t*)malloc(b->cap * sizeof(size_t));
+    c->prev = (size_t*)malloc(b->cap * sizeof(size_t));
+    c->next = (size_t*)malloc(b->cap * sizeof(size_t));
+    c->evicted = hashmap_clone(b->evicted);
+    *copy = NULL;
+    if (c->buckets != NULL && c->hashes != NULL && c->prev != NULL &&
+        c->next != NULL && c->evicted != NULL)
+    {
+        memcpy(c->buckets, buckets, nbuckets * bucketsz);
+        memcpy(c->hashes, b->hashes, b->n * sizeof(size_t));
+        memcpy(c->prev, b->prev, b->n * sizeof(size_t));
+        memcpy(c->next, b->next, b->n * sizeof(size_t));
+        *copy = hashmap_new_with_buckets(sizeof(hash_to_slot), c->buckets,
+                                         nbuckets, hashmap_count(mem), 0, 0,
+                                         hash_int, compare_int, NULL, c,
+                                         budget_release, c);
+    }
+    if (*copy == NULL)
+        budget_release(c);
+    else
+        hashmap_set_tag(*copy, STATE_COPIES);
+    return *copy != NULL;
+}
+
+bool scb_state_clone(scb_state mem, scb_state* copy)
+{
+    state_budget* b = (state_budget*)hashmap_udata(mem);
+    if (b != NULL)
+        return budget_clone(mem, b, copy);
+    *copy = hashmap_clone(mem);
+    return *copy != NULL;
+}
+
+bool scb_state_snapshot(scb_state mem)
+{
+    // The entries of a budget are changed in place, and with its lists.
+    return hashmap_udata(mem) == NULL && hashmap_snapshot(mem);
+}
+
+void scb_state_commit(scb_state mem)
+{
+    hashmap_commit(mem);
+}
+
+bool scb_state_rollback(scb_state mem)
+{
+    return hashmap_rollback(mem);
+}
+
+void scb_state_set_incremental(scb_state mem, const bool incremental)
+{
+    if (mem != NULL)
+        hashmap_set_incremental(mem, incremental);
+}
+
+#define MERGE_CHUNK (1 << 16) // Buckets of a source gathered at a time
+
+typedef struct merge_job
+{
+    scb_state* srcs;       // States merged, in order of precedence
+    size_t* chunk_src;     // Source of each chunk of buckets
+    size_t* chunk_begin;   // Its first bucket
+    size_t* chunk_at;      // Its first record (its count, at first)
+    const void** items;    // Records: entries of all sources in order
+    hash_to_index* pairs;  // Hash of each record, then bucket of each kept
+    size_t total;          // Records
+    scb_state out;
+    size_t slices;         // Ranges of buckets of `out` swept in parallel
+    size_t n;              // Entries kept
+    size_t* placed;        // Entries placed by each slice
+} merge_job;
+
+// Counts (if `items` is still NULL) or gathers the entries of the chunks.
+static void merge_gather(size_t begin, size_t end, void* udata)
+{
+    merge_job* job = (merge_job*)udata;
+    for (size_t c = begin; c < end; ++c)
+    {
+        scb_state src = job->srcs[job->chunk_src[c]];
+        size_t i = job->chunk_begin[c];
+        size_t stop = i + MERGE_CHUNK;
+        size_t at = job->chunk_at[c];
+        void* item;
+        size_t n = 0;
+        while (i < stop && hashmap_iter(src, &i, &item) && i <= stop)
+        {
+            if (job->items != NULL)
+            {
+                job->items[at + n] = item;
+                job->pairs[at + n] = (hash_to_index){
+                    .hash = hashmap_hash(src, item), .index = at + n };
+            }
+            ++n;
+        }
+        if (job->items == NULL)
+            job->chunk_at[c] = n;
+    }
+}
+
+// Sweeps the buckets of `out` from that of the first entry of each slice up
+// to that of the next slice.
+static void merge_place(size_t begin, size_t end, void* udata)
+{
+    merge_job* job = (merge_job*)udata;
+    for (size_t k = begin; k < end; ++k)
+    {
+        size_t from = k * job->n / job->slices;
+        size_t to = (k + 1) * job->n / job->slices;
+        const void** items = job->items + job->total + from;
+        for (size_t j = from; j < to; ++j)
+            items[j - from] = job->items[job->pairs[j].index];
+        size_t stop = to < job->n ? job->pairs[to].hash : SIZE_MAX;
+        job->placed[k] = hashmap_place(job->out, items, to - from, stop);
+    }
+}
+
+// The number of buckets of a table for `n` entries.
+static size_t merge_buckets(const size_t n)
+{
+    size_t nbuckets = 16;
+    while (n > nbuckets / 4 * 3)
+        nbuckets *= 2;
+    return nbuckets;
+}
+
+bool scb_state_merge(scb_state* mem, scb_state* parts, const size_t n,
+                     const size_t threads)
+{
+    // The sources, of the same kind of decryption state.
+    scb_state* srcs = (scb_state*)malloc((n + 1) * sizeof(scb_state));
+    if (srcs == NULL)
+        return false;
+    size_t nsrcs = 0;
+    int kind = STATE_COUNTS;
+    size_t nchunks = 0;
+    bool ok = true;
+    for (size_t i = 0; i <= n; ++i)
+    {
+        scb_state src = i == 0 ? *mem : parts[i - 1];
+        if (src == NULL)
+            continue;
+        size_t nbuckets;
+        size_t sz;
+        hashmap_buckets(src, &nbuckets, &sz); // Also finishes any move
+        ok &= hashmap_udata(src) == NULL && hashmap_tag(src) != STATE_COUNTS &&
+              (nsrcs == 0 || hashmap_tag(src) == kind);
+        kind = hashmap_tag(src);
+        nchunks += (nbuckets + MERGE_CHUNK - 1) / MERGE_CHUNK;
+        srcs[nsrcs++] = src;
+    }
+    if (!ok || nsrcs == 0)
+    {
+        free(srcs);
+        return ok;
+    }
+
+    // Gather the entries of all sources as records, in order of precedence,
+    // with two passes over chunks of their buckets: one counting them, one
+    // filling them in (and hashing them).
+    merge_job job = { .srcs = srcs };
+    job.chunk_src = (size_t*)malloc((nchunks + 1) * sizeof(size_t));
+    job.chunk_begin = (size_t*)malloc((nchunks + 1) * sizeof(size_t));
+    job.chunk_at = (size_t*)calloc(nchunks + 1, sizeof(size_t));
+    ok = job.chunk_src != NULL && job.chunk_begin != NULL &&
+         job.chunk_at != NULL;
+    for (size_t s = 0, c = 0; ok && s < nsrcs; ++s)
+    {
+        size_t nbuckets;
+        size_t sz;
+        hashmap_buckets(srcs[s], &nbuckets, &sz);
+        for (size_t i = 0; i < nbuckets; i += MERGE_CHUNK, ++c)
+        {
+            job.chunk_src[c] = s;
+            job.chunk_begin[c] = i;
+        }
+    }
+    if (ok)
+    {
+        parallel_for(threads, nchunks, merge_gather, &job);
+        for (size_t c = 0; c < nchunks; ++c)
+        {
+            size_t count = job.chunk_at[c];
+            job.chunk_at[c] = job.total;
+            job.total += count;
+        }
+        // Room for the records, and then for the entries kept in sorted
+        // order.
+        job.items = (const void**)malloc((2 * job.total + 1) *
+                                         sizeof(void*));
+        job.pairs = (hash_to_index*)malloc((job.total + 1) *
+                                           sizeof(hash_to_index));
+        ok = job.items != NULL && job.pairs != NULL;
+    }
+    if (ok)
+        parallel_for(threads, nchunks, merge_gather, &job);
+
+    // Sort the records by bucket in a table for all of them. Equal keys
+    // share a bucket, and the stable sort keeps them in order, so the first
+    // of each is the one that wins.
+    size_t nbuckets = merge_buckets(job.total);
+    if (ok)
+    {
+        for (size_t j = 0; j < job.total; ++j)
+            job.pairs[j].hash &= nbuckets - 1;
+        ok = sort_pairs(job.pairs, job.total);
+    }
+    for (size_t j = 0, run = 0; ok && j < job.total; ++j)
+    {
+        if (j > 0 && job.pairs[j].hash != job.pairs[j - 1].hash)
+            run = job.n;
+        size_t key = *(const size_t*)job.items[job.pairs[j].index];
+        size_t r = run;
+        while (r < job.n && key != *(const size_t*)job.items[job.pairs[r].index])
+            ++r;
+        if (r == job.n)
+            job.pairs[job.n++] = job.pairs[j];
+    }
+
+    // With many repeated keys, the table for the entries kept is smaller,
+    // and they are sorted again for it (its buckets are a prefix of those).
+    if (ok && merge_buckets(job.n) < nbuckets)
+    {
+        nbuckets = merge_buckets(job.n);
+        for (size_t j = 0; j < job.n; ++j)
+            job.pairs[j].hash &= nbuckets - 1;
+        ok = sort_pairs(job.pairs, job.n);
+    }
+
+    // Load the table in slices swept in parallel. Entries that do not fit
+    // in their slice are set after.
+    if (ok)
+    {
+        job.out = hashmap_new(kind == STATE_COPIES ? sizeof(hash_to_copy) :
+                              sizeof(hash_to_block), nbuckets, 0, 0,
+                              hash_int, compare_int, NULL, NULL);
+        job.slices = job.n < 1024 ? 1 : 4 * parallel_threads(threads);
+        job.placed = (size_t*)malloc(job.slices * sizeof(size_t));
+        ok = job.out != NULL && job.placed != NULL;
+    }
+    if (ok)
+    {
+        hashmap_set_tag(job.out, kind);
+        parallel_for(threads, job.slices, merge_place, &job);
+        size_t placed = 0;
+        for (size_t k = 0; k < job.slices; ++k)
+            placed += job.placed[k];
+        hashmap_placed(job.out, placed);
+    }
+    for (size_t k = 0; ok && k < job.slices; ++k)
+    {
+        size_t from = k * job.n / job.slices;
+        size_t to = (k + 1) * job.n / job.slices;
+        for (size_t j = from + job.placed[k]; ok && j < to; ++j)
+        {
+            hashmap_set(job.out, job.items[job.total + j]);
+            ok = !hashmap_oom(job.out);
+        }
+    }
+
+    free(job.chunk_src);
+    free(job.chunk_begin);
+    free(job.chunk_at);
+    free(job.items);
+    free(job.pairs);
+    free(job.placed);
+    free(srcs);
+    if (!ok)
+    {
+        if (job.out != NULL)
+            hashmap_free(job.out);
+        return false;
+    }
+    scb_state_free(*mem);
+    *mem = job.out;
+    return true;
+}
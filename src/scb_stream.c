@@ -0,0 +1,158 @@
+// Copyright (C) 2022 Fabio Banfi. All rights reserved.
+// Use of this source code is governed by an MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT.
+
+// Incremental encryption and decryption. Since the ciphertext stealing of a
+// partial last block touches the block before it, a stream holds back the
+// last full block and the partial tail (at most 32 bytes) until it knows
+// where the message ends.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "scb.h"
+#include "scb_core.h"
+
+static void stream_init(scb_stream* s, const uint8_t* key,
+                        const size_t max_count, const size_t max_hash,
+                        scb_state* mem, const state_kind kind)
+{
+    memcpy(s->key, key, 16 * sizeof(uint8_t));
+    s->max_count = max_count;
+    s->max_hash = max_hash;
+    s->mem = mem;
+    s->sort = false;
+    s->threads = 1;
+    s->copy = false;
+    s->buf_len = 0;
+    if (*mem == NULL)
+        *mem = state_new(kind);
+}
+
+// Processes `len` bytes (a multiple of 16), none of which is at the end of
+// the message. The sorting and parallel engines fail without touching
+// anything if out of memory, and the sequential ones then take over.
+static void stream_blocks(scb_stream* s, const uint8_t* in, const size_t len,
+                          uint8_t* out, const bool enc)
+{
+    bool parallel = len > 16 && s->threads != 1;
+    if (enc && (!s->sort || len == 16 ||
+                !scb_encrypt_sort(s->key, in, out, len, s->max_count,
+                                  s->max_hash, s->mem, s->threads)))
+        scb_encrypt(s->key, in, out, len, s->max_count, s->max_hash, s->mem);
+    else if (!enc && s->copy &&
+             (!parallel || !scb_decrypt_parallel_copy(s->key, in, out, len,
+                                                      s->max_count,
+                                                      s->max_hash, s->mem,
+                                                      s->threads)))
+        scb_decrypt_copy(s->key, in, out, len, s->max_count, s->max_hash,
+                         s->mem);
+    else if (!enc && !s->copy &&
+             (!parallel || !scb_decrypt_parallel(s->key, in, out, len,
+                                                 s->max_count, s->max_hash,
+                                                 s->mem, s->threads)))
+        scb_decrypt(s->key, in, out, len, s->max_count, s->max_hash, s->mem);
+}
+
+static size_t stream_update(scb_stream* s, const uint8_t* in, size_t len,
+                            uint8_t* out, const bool enc)
+{
+    size_t done = 0;
+
+    // First complete and process the held back blocks, as long as more than
+    // 32 bytes are pending.
+    while (s->buf_len > 0 && s->buf_len + len > 32)
+    {
+        if (s->buf_len < 16)
+        {
+            size_t n = 16 - s->buf_len;
+            memcpy(s->buf + s->buf_len, in, n * sizeof(uint8_t));
+            s->buf_len = 16;
+            in += n;
+            len -= n;
+        }
+        stream_blocks(s, s->buf, 16, out + done, enc);
+        memmove(s->buf, s->buf + 16, (s->buf_len - 16) * sizeof(uint8_t));
+        s->buf_len -= 16;
+        done += 16;
+    }
+
+    // Then all the new blocks but the last 17 to 32 bytes.
+    if (len > 32)
+    {
+        size_t n = (len - 17) / 16 * 16;
+        stream_blocks(s, in, n, out + done, enc);
+        in += n;
+        len -= n;
+        done += n;
+    }
+
+    memcpy(s->buf + s->buf_len, in, len * sizeof(uint8_t));
+    s->buf_len += len;
+    return done;
+}
+
+void scb_encrypt_init(scb_stream* s, const uint8_t* key,
+                      const size_t max_count, const size_t max_hash,
+                      scb_state* mem)
+{
+    stream_init(s, key, max_count, max_hash, mem, STATE_COUNTS);
+}
+
+size_t scb_encrypt_update(scb_stream* s, const uint8_t* ptx, const size_t len,
+                          uint8_t* ctx)
+{
+    return stream_update(s, ptx, len, ctx, true);
+}
+
+size_t scb_encrypt_final(scb_stream* s, uint8_t* ctx)
+{
+    // What is left is exactly the end of the message as scb_encrypt sees it.
+    size_t len = s->buf_len;
+    s->buf_len = 0;
+    if (len < 16)
+        return 0;
+
+    scb_encrypt(s->key, s->buf, ctx, len, s->max_count, s->max_hash, s->mem);
+    return len;
+}
+
+void scb_decrypt_init(scb_stream* s, const uint8_t* key,
+                      const size_t max_count, const size_t max_hash,
+                      scb_state* mem)
+{
+    stream_init(s, key, max_count, max_hash, mem, STATE_BLOCKS);
+}
+
+size_t scb_decrypt_update(scb_stream* s, const uint8_t* ctx, const size_t len,
+                          uint8_t* ptx)
+{
+    return stream_update(s, ctx, len, ptx, false);
+}
+
+size_t scb_decrypt_final(scb_stream* s, uint8_t* ptx)
+{
+    size_t len = s->buf_len;
+    s->buf_len = 0;
+    if (len < 16)
+        return 0;
+
+    if (s->copy)
+        scb_decrypt_copy(s->key, s->buf, ptx, len, s->max_count, s->max_hash,
+                         s->mem);
+    else
+        scb_decrypt(s->key, s->buf, ptx, len, s->max_count, s->max_hash,
+                    s->mem);
+    return len;
+}
+
+void scb_decrypt_init_copy(scb_stream* s, const uint8_t* key,
+                           const size_t max_count, const size_t max_hash,
+                           scb_state* mem)
+{
+    stream_init(s, key, max_count, max_hash, mem, STATE_COPIES);
+    s->copy = true;
+}
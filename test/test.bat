@@ -40,4 +40,15 @@ del cor\tux.enc_2_1.dec.png
 del cor\tux.enc_2_2.dec.png
 del cor\tux.enc_2_3.dec.png
 
+copy cor\tux.png tux > nul
+..\bin\scb_file.exe enc 2 1 key tux
+..\bin\scb_file.exe dec 2 1 key tux.enc_2_1
+move tux.enc_2_1.dec tux.enc_2_1.ref > nul
+..\bin\scb_file.exe dec 2 1 key tux.enc_2_1 threads=4
+
+fc /b tux.enc_2_1.ref tux.enc_2_1.dec > nul
+if errorlevel 1 (echo FAIL) else (echo OK)
+
+del tux tux.enc_2_1 tux.enc_2_1.ref tux.enc_2_1.dec
+
 del key
\ No newline at end of file
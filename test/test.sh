@@ -34,4 +34,124 @@ rm cor/tux.enc_2_1.dec.png
 rm cor/tux.enc_2_2.dec.png
 rm cor/tux.enc_2_3.dec.png
 
+cp cor/tux.png tux
+../bin/scb_file enc 2 1 key tux
+../bin/scb_file dec 2 1 key tux.enc_2_1
+mv tux.enc_2_1.dec tux.enc_2_1.ref
+../bin/scb_file dec 2 1 key tux.enc_2_1 threads=4
+
+if diff -q tux.enc_2_1.{ref,dec}; then echo "OK"; else echo "FAIL"; fi
+
+../bin/scb_file dec 2 1 key tux.enc_2_1 mem=16M
+
+if diff -q tux.enc_2_1.{ref,dec}; then echo "OK"; else echo "FAIL"; fi
+
+mv tux.enc_2_1 tux.enc_2_1.hash
+../bin/scb_file enc 2 1 key tux engine=ext mem=64K
+
+if diff -q tux.enc_2_1{.hash,}; then echo "OK"; else echo "FAIL"; fi
+
+../bin/scb_file enc 2 1 key tux chunk=48
+
+if diff -q tux.enc_2_1{.hash,}; then echo "OK"; else echo "FAIL"; fi
+
+../bin/scb_file enc 2 1 key tux engine=pipe chunk=4K
+
+if diff -q tux.enc_2_1{.hash,}; then echo "OK"; else echo "FAIL"; fi
+
+../bin/scb_file enc 2 1 key tux mmap
+
+if diff -q tux.enc_2_1{.hash,}; then echo "OK"; else echo "FAIL"; fi
+
+cat tux | ../bin/scb_file enc 2 1 key - > tux.enc_2_1
+
+if diff -q tux.enc_2_1{.hash,}; then echo "OK"; else echo "FAIL"; fi
+
+cp tux tux.tmp
+../bin/scb_file enc 2 1 key tux.tmp inplace
+
+if diff -q tux.enc_2_1.hash tux.tmp.enc_2_1; then echo "OK"; else echo "FAIL"; fi
+
+../bin/scb_file dec 2 1 key tux.tmp.enc_2_1 inplace
+
+if diff -q tux.enc_2_1.ref tux.tmp.enc_2_1.dec; then echo "OK"; else echo "FAIL"; fi
+
+rm tux.tmp.enc_2_1.dec
+
+../bin/scb_file enc 2 1 key tux index
+../bin/scb_file dec-range 2 1 key tux.enc_2_1 offset=1000 length=3000 > tux.part
+
+if tail -c +1001 tux.enc_2_1.ref | head -c 3000 | diff -q - tux.part; then echo "OK"; else echo "FAIL"; fi
+
+../bin/scb_file dec-range 2 1 key tux.enc_2_1 offset=10740 > tux.part
+
+if tail -c +10741 tux.enc_2_1.ref | diff -q - tux.part; then echo "OK"; else echo "FAIL"; fi
+
+rm tux.part tux.enc_2_1.idx
+
+../bin/scb_file enc 2 8 key tux chunked=4K header threads=2
+../bin/scb_file dec 0 0 key tux.enc_2_8 chunk=16K
+
+if diff -q tux tux.enc_2_8.dec; then echo "OK"; else echo "FAIL"; fi
+
+../bin/scb_file dec-range 0 0 key tux.enc_2_8 offset=1000 length=9000 > tux.part
+
+if tail -c +1001 tux | head -c 9000 | diff -q - tux.part; then echo "OK"; else echo "FAIL"; fi
+
+rm tux.part tux.enc_2_8 tux.enc_2_8.dec
+
+../bin/scb_file enc 2 1 key tux header
+../bin/scb_file dec 0 0 key tux.enc_2_1
+
+if diff -q tux.enc_2_1.ref tux.enc_2_1.dec; then echo "OK"; else echo "FAIL"; fi
+
+head -c 5000 tux > tux.log
+../bin/scb_file enc-append 2 1 key tux.log
+tail -c +5001 tux >> tux.log
+../bin/scb_file enc-append 2 1 key tux.log
+
+if diff -q tux.enc_2_1.hash tux.log.enc_2_1; then echo "OK"; else echo "FAIL"; fi
+
+rm tux.log tux.log.enc_2_1 tux.log.enc_2_1.state
+
+head -c 20000 tux > tux.upd
+../bin/scb_file enc 2 1 key tux.upd checkpoint=4K
+tail -c +20001 tux >> tux.upd
+../bin/scb_file enc-update 2 1 key tux.upd
+
+if diff -q tux.enc_2_1.hash tux.upd.enc_2_1; then echo "OK"; else echo "FAIL"; fi
+
+rm tux.upd tux.upd.enc_2_1 tux.upd.enc_2_1.ckpt
+
+cp tux tux.tbl
+../bin/scb_file enc 2 1 key tux.tbl table=.
+
+if diff -q tux.enc_2_1.hash tux.tbl.enc_2_1; then echo "OK"; else echo "FAIL"; fi
+
+rm tux.tbl tux.tbl.enc_2_1
+
+seq -f %015g 1 10000 > tux.plan
+../bin/scb_file plan 2 1 key tux.plan samples=100 > tux.out
+
+if grep -q "repeated about 0 times" tux.out; then echo "OK"; else echo "FAIL"; fi
+
+head -c 16000 /dev/zero > tux.plan
+../bin/scb_file plan 2 1 key tux.plan > tux.out
+
+if grep -q "About 1 distinct blocks, the most frequent one repeated about 999 times" tux.out; then echo "OK"; else echo "FAIL"; fi
+
+rm tux.plan tux.out
+
+mkdir -p dir/sub
+cp tux dir/sub/tux
+../bin/scb_file enc-dir 2 1 key dir threads=2
+
+if diff -q tux.enc_2_1.hash dir/sub/tux.enc_2_1; then echo "OK"; else echo "FAIL"; fi
+
+rm -r dir
+
+rm tux tux.enc_2_1 tux.enc_2_1.hash tux.enc_2_1.ref tux.enc_2_1.dec
+
+if ../bin/scb_bench 12 > /dev/null; then echo "OK"; else echo "FAIL"; fi
+
 rm key
\ No newline at end of file